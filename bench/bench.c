@@ -0,0 +1,282 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Microbenchmark of the monocypher primitives, as built for the package
+//
+//   make            # build ./bench against ../src/monocypher.c
+//   make run        # write results to bench.csv
+//   ./bench -h      # options
+//
+// Every primitive is timed over message sizes from 16 bytes up to 1 GB
+// (in steps of 4x), with the vectorised code paths enabled and then
+// disabled.  Each measurement is repeated, doubling the iterations, until
+// it has run for at least the minimum time.
+//
+//   chacha20   crypto_chacha20_djb(), in place
+//   poly1305   crypto_poly1305().  Dominated by poly_blocks()
+//   blake2b    crypto_blake2b(), 64-byte hash
+//   aead       crypto_aead_init_x() + crypto_aead_write(), in place
+//   argon2     crypto_argon2_threaded(), for several memory/passes/lanes
+//
+// Results are written as CSV, one row per measurement:
+//
+//   primitive,simd,bytes,memory_kb,passes,lanes,threads,iterations,
+//   ms_per_op,mb_per_s,cycles_per_byte
+//
+// Columns which don't apply are left empty.  'simd' is 1 when the
+// vectorised code paths are enabled.  'cycles_per_byte' uses the x86 time
+// stamp counter, which ticks at a constant rate rather than the current
+// core clock, and is empty on other platforms.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "monocypher.h"
+
+// Not part of the package.  Nothing here uses the R API.
+
+#define MIN_SIZE 16
+#define MAX_SIZE ((size_t)1 << 30)
+
+static double   min_time = 0.2;    // seconds per measurement
+static volatile uint8_t sink;      // stops results being optimised away
+
+static uint8_t key  [32];
+static uint8_t nonce[24];
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Clocks
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static uint64_t cycles(void) {
+#ifdef HAVE_TSC
+  return (uint64_t)__rdtsc();
+#else
+  return 0;
+#endif
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Primitives.  Each processes 'n' bytes of 'buf' once
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef void (*bench_fn)(uint8_t *buf, size_t n);
+
+static void run_chacha20(uint8_t *buf, size_t n) {
+  crypto_chacha20_djb(buf, buf, n, key, nonce, 0);
+  sink ^= buf[0];
+}
+
+static void run_poly1305(uint8_t *buf, size_t n) {
+  uint8_t mac[16];
+  crypto_poly1305(mac, buf, n, key);
+  sink ^= mac[0];
+}
+
+static void run_blake2b(uint8_t *buf, size_t n) {
+  uint8_t hash[64];
+  crypto_blake2b(hash, sizeof(hash), buf, n);
+  sink ^= hash[0];
+}
+
+static void run_aead(uint8_t *buf, size_t n) {
+  crypto_aead_ctx ctx;
+  uint8_t mac[16];
+  crypto_aead_init_x(&ctx, key, nonce);
+  crypto_aead_write(&ctx, buf, mac, NULL, 0, buf, n);
+  sink ^= mac[0];
+}
+
+static const struct {
+  const char *name;
+  bench_fn    fn;
+} primitives[] = {
+  {"chacha20", run_chacha20},
+  {"poly1305", run_poly1305},
+  {"blake2b" , run_blake2b },
+  {"aead"    , run_aead    },
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Time 'fn' over 'n' bytes, doubling the iterations until the run takes
+// at least 'min_time'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void bench_stream(FILE *out, const char *name, bench_fn fn, uint8_t *buf, size_t n) {
+
+  fn(buf, n);  // warm up caches, page in the buffer
+
+  uint64_t iters = 1;
+  double   elapsed;
+  uint64_t ncycles;
+  for (;;) {
+    double   t0 = now();
+    uint64_t c0 = cycles();
+    for (uint64_t i = 0; i < iters; i++) {
+      fn(buf, n);
+    }
+    ncycles = cycles() - c0;
+    elapsed = now() - t0;
+    if (elapsed >= min_time) break;
+    iters *= 2;
+  }
+
+  double bytes = (double)n * (double)iters;
+  fprintf(out, "%s,%d,%zu,,,,,%llu,%.6f,%.2f,", name, crypto_simd_enabled, n,
+          (unsigned long long)iters, 1e3 * elapsed / (double)iters, bytes / elapsed / 1e6);
+#ifdef HAVE_TSC
+  fprintf(out, "%.3f", (double)ncycles / bytes);
+#endif
+  fprintf(out, "\n");
+  fflush(out);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Time one Argon2id configuration
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void bench_argon2(FILE *out, uint32_t memory_kb, uint32_t passes, uint32_t lanes,
+                         int threads) {
+
+  void *work_area = malloc((size_t)memory_kb * 1024);
+  if (work_area == NULL) {
+    fprintf(stderr, "argon2: couldn't allocate %u kB\n", memory_kb);
+    return;
+  }
+
+  crypto_argon2_config config = {
+    .algorithm = CRYPTO_ARGON2_ID,
+    .nb_blocks = memory_kb,
+    .nb_passes = passes,
+    .nb_lanes  = lanes
+  };
+  crypto_argon2_inputs inputs = {
+    .pass = (const uint8_t *)"my secret",
+    .salt = nonce,
+    .pass_size = 9,
+    .salt_size = 16
+  };
+
+  uint8_t hash[32];
+  uint64_t iters = 0;
+  double t0 = now();
+  double elapsed;
+  do {
+    crypto_argon2_threaded(hash, sizeof(hash), work_area, config, inputs,
+                           crypto_argon2_no_extras, threads);
+    sink ^= hash[0];
+    iters++;
+    elapsed = now() - t0;
+  } while (elapsed < min_time);
+
+  fprintf(out, "argon2,%d,,%u,%u,%u,%d,%llu,%.3f,,\n", crypto_simd_enabled, memory_kb,
+          passes, lanes, threads, (unsigned long long)iters, 1e3 * elapsed / (double)iters);
+  fflush(out);
+  free(work_area);
+}
+
+
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: bench [-m max_bytes] [-t min_seconds] [-p primitive] [-o file.csv]\n"
+          "  -m  largest message size. Default: 1073741824 (1 GB)\n"
+          "  -t  minimum time for each measurement. Default: 0.2\n"
+          "  -p  only run this primitive: chacha20, poly1305, blake2b, aead or argon2\n"
+          "  -o  write CSV here rather than to stdout\n");
+}
+
+
+int main(int argc, char **argv) {
+
+  size_t max_size = MAX_SIZE;
+  const char *only = NULL;
+  FILE *out = stdout;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:t:p:o:h")) != -1) {
+    switch (opt) {
+    case 'm': max_size = (size_t)strtoull(optarg, NULL, 10); break;
+    case 't': min_time = atof(optarg); break;
+    case 'p': only = optarg; break;
+    case 'o':
+      out = fopen(optarg, "w");
+      if (out == NULL) {
+        fprintf(stderr, "Couldn't open '%s' for writing\n", optarg);
+        return 1;
+      }
+      break;
+    default:
+      usage();
+      return opt == 'h' ? 0 : 1;
+    }
+  }
+  if (max_size < MIN_SIZE) {
+    max_size = MIN_SIZE;
+  }
+
+  for (size_t i = 0; i < sizeof(key); i++) key[i] = (uint8_t)i;
+  for (size_t i = 0; i < sizeof(nonce); i++) nonce[i] = (uint8_t)(3 * i);
+
+  uint8_t *buf = malloc(max_size);
+  if (buf == NULL) {
+    fprintf(stderr, "Couldn't allocate %zu bytes.  Try a smaller -m\n", max_size);
+    return 1;
+  }
+  memset(buf, 0x5a, max_size);
+
+  // Without AVX2, the vectorised build still uses 64-bit Poly1305 limbs
+  // when enabled, so both settings are still worth measuring
+  crypto_simd_enabled = 1;
+  fprintf(stderr, "AVX2: %s\n", crypto_simd_avx2() ? "yes" : "no");
+
+  fprintf(out, "primitive,simd,bytes,memory_kb,passes,lanes,threads,iterations,"
+               "ms_per_op,mb_per_s,cycles_per_byte\n");
+
+  for (int simd = 1; simd >= 0; simd--) {
+    crypto_simd_enabled = simd;
+
+    for (size_t p = 0; p < sizeof(primitives) / sizeof(primitives[0]); p++) {
+      if (only != NULL && strcmp(only, primitives[p].name) != 0) continue;
+      for (size_t n = MIN_SIZE; n <= max_size; n *= 4) {
+        fprintf(stderr, "%s simd=%d %zu\n", primitives[p].name, simd, n);
+        bench_stream(out, primitives[p].name, primitives[p].fn, buf, n);
+      }
+    }
+
+    if (only != NULL && strcmp(only, "argon2") != 0) continue;
+    // The package default is 100000 kB, 3 passes, 1 lane
+    static const uint32_t argon2_configs[][4] = {
+      //  kB    passes lanes threads
+      {   1024, 3, 1, 1},
+      {  65536, 3, 1, 1},
+      { 100000, 3, 1, 1},
+      { 262144, 3, 4, 1},
+      { 262144, 3, 4, 4},
+    };
+    for (size_t i = 0; i < sizeof(argon2_configs) / sizeof(argon2_configs[0]); i++) {
+      const uint32_t *c = argon2_configs[i];
+      fprintf(stderr, "argon2 simd=%d %u kB\n", simd, c[0]);
+      bench_argon2(out, c[0], c[1], c[2], (int)c[3]);
+    }
+  }
+
+  free(buf);
+  if (out != stdout) {
+    fclose(out);
+  }
+  return 0;
+}
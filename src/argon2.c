@@ -12,6 +12,8 @@
 #include "monocypher.h"
 #include "utils.h"
 #include "argon2.h"
+#include "workarea.h"
+#include "parallel.h"
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //  Argon function call
@@ -153,6 +155,143 @@
 #define SALTSIZE 16
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The default parameters: Argon2id, 100 MB, 3 passes, single lane
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void argon_default_params(argon_params *params) {
+  params->algorithm = CRYPTO_ARGON2_ID;
+  params->nb_blocks = ARGON2_BLOCKS;
+  params->nb_passes = ARGON2_PASSES;
+  params->nb_lanes  = ARGON2_LANES;
+  params->nthreads  = 1;
+  params->version   = ARGON2_KDF_VERSION;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Set the number of lanes.  Threads follow the number of lanes (but never
+// exceed the number of cores) unless they were set to something else.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int lane_threads(uint32_t nb_lanes) {
+  int ncores = parallel_ncores();
+  return nb_lanes < (uint32_t)ncores ? (int)nb_lanes : ncores;
+}
+
+void argon_set_lanes(argon_params *params, uint32_t nb_lanes) {
+  int follow = params->nthreads == lane_threads(params->nb_lanes);
+  params->nb_lanes = nb_lanes;
+  if (follow) {
+    params->nthreads = lane_threads(nb_lanes);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Find a named element in a list. Returns R_NilValue if not present
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP list_elt(SEXP list_, const char *name) {
+  SEXP names_ = Rf_getAttrib(list_, R_NamesSymbol);
+  if (Rf_isNull(names_)) return R_NilValue;
+  
+  for (R_xlen_t i = 0; i < Rf_xlength(list_); i++) {
+    if (strcmp(CHAR(STRING_ELT(names_, i)), name) == 0) {
+      return VECTOR_ELT(list_, i);
+    }
+  }
+  
+  return R_NilValue;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Unpack a user-supplied set of Argon2 parameters
+//
+// @param kdf_ NULL for the defaults, or a named list as created by 
+//        kdf_params() with any of: memory, passes, lanes, variant, threads,
+//        version.
+//        Missing elements take their default value.
+// @param params output
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void unpack_argon_params(SEXP kdf_, argon_params *params) {
+  
+  argon_default_params(params);
+  
+  if (Rf_isNull(kdf_)) {
+    return;
+  } else if (TYPEOF(kdf_) != VECSXP) {
+    Rf_error("unpack_argon_params(): 'kdf' must be a list created by kdf_params()");
+  }
+  
+  SEXP elt_;
+  
+  elt_ = list_elt(kdf_, "lanes");
+  if (!Rf_isNull(elt_)) {
+    int lanes = Rf_asInteger(elt_);
+    if (lanes == NA_INTEGER || lanes < 1 || lanes > 0xFFFFFF) {
+      Rf_error("unpack_argon_params(): 'lanes' must be between 1 and %i", 0xFFFFFF);
+    }
+    argon_set_lanes(params, (uint32_t)lanes);
+  }
+  
+  elt_ = list_elt(kdf_, "memory");
+  if (!Rf_isNull(elt_)) {
+    int memory = Rf_asInteger(elt_);
+    if (memory == NA_INTEGER || memory < 8) {
+      Rf_error("unpack_argon_params(): 'memory' must be at least 8 kB");
+    }
+    params->nb_blocks = (uint32_t)memory;
+  }
+  if (params->nb_blocks < 8 * params->nb_lanes) {
+    Rf_error("unpack_argon_params(): 'memory' must be at least 8 kB per lane");
+  }
+  
+  elt_ = list_elt(kdf_, "passes");
+  if (!Rf_isNull(elt_)) {
+    int passes = Rf_asInteger(elt_);
+    if (passes == NA_INTEGER || passes < 1) {
+      Rf_error("unpack_argon_params(): 'passes' must be at least 1");
+    }
+    params->nb_passes = (uint32_t)passes;
+  }
+  
+  elt_ = list_elt(kdf_, "variant");
+  if (!Rf_isNull(elt_)) {
+    if (TYPEOF(elt_) != STRSXP || Rf_length(elt_) != 1) {
+      Rf_error("unpack_argon_params(): 'variant' must be one of 'id', 'i' or 'd'");
+    }
+    const char *variant = CHAR(STRING_ELT(elt_, 0));
+    if (strcmp(variant, "id") == 0) {
+      params->algorithm = CRYPTO_ARGON2_ID;
+    } else if (strcmp(variant, "i") == 0) {
+      params->algorithm = CRYPTO_ARGON2_I;
+    } else if (strcmp(variant, "d") == 0) {
+      params->algorithm = CRYPTO_ARGON2_D;
+    } else {
+      Rf_error("unpack_argon_params(): 'variant' must be one of 'id', 'i' or 'd'");
+    }
+  }
+  
+  // kdf_params() sets 'threads' to the number of lanes by default
+  elt_ = list_elt(kdf_, "threads");
+  if (!Rf_isNull(elt_)) {
+    int threads = unpack_threads(elt_);
+    if (threads != (int)params->nb_lanes) {
+      params->nthreads = threads;
+    }
+  }
+  
+  elt_ = list_elt(kdf_, "version");
+  if (!Rf_isNull(elt_)) {
+    int version = Rf_asInteger(elt_);
+    if (version != ARGON2_KDF_LEGACY && version != ARGON2_KDF_V1) {
+      Rf_error("unpack_argon_params(): 'version' must be %i or %i", 
+               ARGON2_KDF_LEGACY, ARGON2_KDF_V1);
+    }
+    params->version = version;
+  }
+}
+
+
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Internal argon2 function to wrap monocypher call
@@ -162,17 +301,19 @@
 // @param salt 16-byte salt
 // @param hash destination buffer for the calculated hash
 // @param hash_length length of hash in bytes. Use 32 for key.
+// @param params Argon2 variant and costs, and the number of threads
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void argon_internal(uint8_t *password, size_t pass_size, uint8_t *salt, uint8_t *hash, uint32_t hash_length) {
+void argon_internal(uint8_t *password, size_t pass_size, uint8_t *salt, uint8_t *hash, uint32_t hash_length,
+                    const argon_params *params) {
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Argon2 Config
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   crypto_argon2_config config = {
-    .algorithm = CRYPTO_ARGON2_ID,            /* Argon2i        */
-    .nb_blocks = 100000,                     /* 100 megabytes   */
-    .nb_passes = 3,                          /* 3 iterations    */
-    .nb_lanes  = 1                           /* Single-threaded */
+    .algorithm = params->algorithm,          /* Variant         */
+    .nb_blocks = params->nb_blocks,          /* Memory in kB    */
+    .nb_passes = params->nb_passes,          /* Iterations      */
+    .nb_lanes  = params->nb_lanes            /* Parallelism     */
   };
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -191,9 +332,10 @@ void argon_internal(uint8_t *password, size_t pass_size, uint8_t *salt, uint8_t
   crypto_argon2_extras extras = {0};   /* Extra parameters unused */
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Allocate work area.
+  // Work area. Reused across calls, unless larger than the default needs
+  // (see workarea.c)
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  void *work_area = malloc((size_t)config.nb_blocks * 1024);
+  void *work_area = workarea_get((size_t)config.nb_blocks * 1024);
   
   if (work_area == NULL) {
     Rf_error("argon2_(): Could not allocate memory for 'work_area'");
@@ -202,8 +344,8 @@ void argon_internal(uint8_t *password, size_t pass_size, uint8_t *salt, uint8_t
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Derive Key
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  crypto_argon2(hash, hash_length, work_area, config, inputs, extras);
-  free(work_area);
+  crypto_argon2_threaded(hash, hash_length, work_area, config, inputs, extras, params->nthreads);
+  workarea_release();
 }
 
 
@@ -214,8 +356,20 @@ void argon_internal(uint8_t *password, size_t pass_size, uint8_t *salt, uint8_t
 // @param password_ password
 // @param salt_ 16 byte salt. Or hex string. Or shorter string to be expanded
 // @param hash_length_ output key length
+// @param type_ 'chr' or 'raw'
+// @param kdf_ Argon2 parameters. NULL or list created by kdf_params()
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-SEXP argon2_(SEXP password_, SEXP salt_, SEXP hash_length_, SEXP type_) {
+SEXP argon2_(SEXP password_, SEXP salt_, SEXP hash_length_, SEXP type_, SEXP kdf_) {
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Variant, memory, passes, lanes and threads
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  argon_params params;
+  unpack_argon_params(kdf_, &params);
+  
+  // argon2() always expands a text salt the original way, so its output
+  // doesn't depend on the version
+  params.version = ARGON2_KDF_LEGACY;
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Password
@@ -227,7 +381,7 @@ SEXP argon2_(SEXP password_, SEXP salt_, SEXP hash_length_, SEXP type_) {
   // Salt
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   uint8_t salt[16] = { 0 };
-  unpack_salt(salt_, salt);
+  unpack_salt(salt_, &params, salt);
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Hash
@@ -241,7 +395,7 @@ SEXP argon2_(SEXP password_, SEXP salt_, SEXP hash_length_, SEXP type_) {
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Derive key
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  argon_internal((uint8_t *)password, pass_size, salt, hash, (uint32_t)N);
+  argon_internal((uint8_t *)password, pass_size, salt, hash, (uint32_t)N, &params);
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Tidy and return
@@ -1 +1,52 @@
-void argon_internal(uint8_t *password, size_t pass_size, uint8_t *salt, uint8_t *hash, uint32_t hash_length);
+#ifndef RMONOCYPHER_ARGON2_H
+#define RMONOCYPHER_ARGON2_H
+
+#include <stdint.h>
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Argon2 cost parameters used to derive keys from passwords
+//
+// algorithm  CRYPTO_ARGON2_D, CRYPTO_ARGON2_I or CRYPTO_ARGON2_ID
+// nb_blocks  memory cost in 1 kB blocks. At least 8 x nb_lanes
+// nb_passes  time cost
+// nb_lanes   degree of parallelism. Changes the output
+// nthreads   threads used to compute the lanes. Does not change the output
+// version    how a salt is derived from a text key or salt.  See below
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  uint32_t algorithm;
+  uint32_t nb_blocks;
+  uint32_t nb_passes;
+  uint32_t nb_lanes;
+  int      nthreads;
+  int      version;
+} argon_params;
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Key derivation versions
+//
+// legacy - the salt is derived by running Argon2 on the text with a fixed
+//          salt. So deriving a key from a password runs Argon2 twice.
+// 1      - the salt is a domain-separated BLAKE2b hash of the text
+//
+// Data which records the version (see stream.h) is decrypted with the 
+// version it was written with.  Data which doesn't always uses 'legacy'.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define ARGON2_KDF_LEGACY  0
+#define ARGON2_KDF_V1      1
+#define ARGON2_KDF_VERSION ARGON2_KDF_V1
+
+// Defaults.  These must not change, or keys derived from passwords by 
+// earlier versions of the package could not be recreated
+#define ARGON2_BLOCKS 100000
+#define ARGON2_PASSES 3
+#define ARGON2_LANES  1
+
+void argon_default_params(argon_params *params);
+void unpack_argon_params(SEXP kdf_, argon_params *params);
+void argon_set_lanes(argon_params *params, uint32_t nb_lanes);
+
+void argon_internal(uint8_t *password, size_t pass_size, uint8_t *salt, uint8_t *hash, uint32_t hash_length,
+                    const argon_params *params);
+
+#endif
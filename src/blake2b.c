@@ -0,0 +1,192 @@
+#define R_NO_REMAP
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include "monocypher.h"
+#include "utils.h"
+#include "parallel.h"
+#include "mapfile.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// BLAKE2b tree hashing (BLAKE2bp)
+//
+// The input is dealt out to 'leaves' leaf nodes one 128-byte block at a 
+// time (block i goes to leaf i % leaves).  Each leaf is an independent 
+// BLAKE2b hash, so leaves can be computed in parallel.  The root node 
+// hashes the concatenated 64-byte leaf hashes.
+//
+// With 4 leaves this is BLAKE2bp as in the BLAKE2 reference code.  With 8
+// leaves it is the same construction with a fanout of 8.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define BLAKE2B_BLOCKSIZE 128
+#define BLAKE2B_MAXLEAVES   8
+
+typedef struct {
+  const uint8_t *data;
+  size_t         size;
+  const uint8_t *key;
+  size_t         key_size;
+  size_t         hash_size;
+  size_t         leaves;
+  uint8_t        leaf_hash[BLAKE2B_MAXLEAVES][64];
+} blake2b_tree;
+
+
+static void blake2b_leaf(void *arg, size_t i) {
+  blake2b_tree *t = (blake2b_tree *)arg;
+  
+  crypto_blake2b_node node = {
+    .node_offset = i,
+    .leaf_size   = 0,
+    .digest_size = (uint8_t)t->hash_size,
+    .key_size    = (uint8_t)t->key_size,
+    .fanout      = (uint8_t)t->leaves,
+    .depth       = 2,
+    .node_depth  = 0,
+    .inner_size  = 64
+  };
+  
+  crypto_blake2b_ctx ctx;
+  crypto_blake2b_node_init(&ctx, 64, t->key, t->key_size, &node);
+  
+  size_t stride = t->leaves * BLAKE2B_BLOCKSIZE;
+  for (size_t off = i * BLAKE2B_BLOCKSIZE; off < t->size; off += stride) {
+    size_t n = t->size - off;
+    crypto_blake2b_update(&ctx, t->data + off, n < BLAKE2B_BLOCKSIZE ? n : BLAKE2B_BLOCKSIZE);
+  }
+  
+  if (i == t->leaves - 1) {
+    crypto_blake2b_final_last_node(&ctx, t->leaf_hash[i]);
+  } else {
+    crypto_blake2b_final(&ctx, t->leaf_hash[i]);
+  }
+}
+
+
+static void blake2b_root(blake2b_tree *t, uint8_t *hash) {
+  crypto_blake2b_node node = {
+    .node_offset = 0,
+    .leaf_size   = 0,
+    .digest_size = (uint8_t)t->hash_size,
+    .key_size    = (uint8_t)t->key_size,
+    .fanout      = (uint8_t)t->leaves,
+    .depth       = 2,
+    .node_depth  = 1,
+    .inner_size  = 64
+  };
+  
+  crypto_blake2b_ctx ctx;
+  crypto_blake2b_node_init(&ctx, t->hash_size, NULL, 0, &node);
+  crypto_blake2b_update(&ctx, t->leaf_hash[0], 64 * t->leaves);
+  crypto_blake2b_final_last_node(&ctx, hash);
+  crypto_wipe(t->leaf_hash, sizeof(t->leaf_hash));
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Hash a raw vector, string or file with BLAKE2b
+//
+// @param x_ raw vector, string, or filename if 'file_' is TRUE
+// @param file_ logical. Is 'x_' a filename?  The file is mapped into memory
+//        rather than read into R
+// @param size_ hash size in bytes. 1 to 64
+// @param key_ NULL, or key as a raw vector or string. 1 to 64 bytes
+// @param leaves_ 1 for BLAKE2b, 4 for BLAKE2bp, or 8
+// @param threads_ number of threads used to hash the leaves
+// @param type_ 'chr' or 'raw'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP blake2b_(SEXP x_, SEXP file_, SEXP size_, SEXP key_, SEXP leaves_, SEXP threads_, SEXP type_) {
+  
+  int hash_size = Rf_asInteger(size_);
+  if (hash_size == NA_INTEGER || hash_size < 1 || hash_size > 64) {
+    Rf_error("blake2b_(): 'size' must be between 1 and 64");
+  }
+  
+  int leaves = Rf_asInteger(leaves_);
+  if (leaves != 1 && leaves != 4 && leaves != 8) {
+    Rf_error("blake2b_(): 'leaves' must be 1, 4 or 8");
+  }
+  
+  int threads = unpack_threads(threads_);
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Key
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const uint8_t *key = NULL;
+  size_t key_size = 0;
+  if (Rf_isNull(key_)) {
+    // unkeyed
+  } else if (TYPEOF(key_) == RAWSXP) {
+    key      = RAW(key_);
+    key_size = (size_t)Rf_xlength(key_);
+  } else if (TYPEOF(key_) == STRSXP && Rf_length(key_) == 1) {
+    key      = (const uint8_t *)CHAR(STRING_ELT(key_, 0));
+    key_size = strlen((const char *)key);
+  } else {
+    Rf_error("blake2b_(): 'key' must be NULL, a raw vector or a string");
+  }
+  if (key != NULL && (key_size < 1 || key_size > 64)) {
+    Rf_error("blake2b_(): 'key' must be between 1 and 64 bytes");
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Data
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  mapped_file mf;
+  memset(&mf, 0, sizeof(mf));
+  const uint8_t *data = NULL;
+  size_t size = 0;
+  
+  if (Rf_asLogical(file_) == 1) {
+    if (TYPEOF(x_) != STRSXP || Rf_length(x_) != 1) {
+      Rf_error("blake2b_(): 'x' must be a filename");
+    }
+    const char *filename = R_ExpandFileName(CHAR(STRING_ELT(x_, 0)));
+    if (mapfile_open(&mf, filename) < 0) {
+      Rf_error("blake2b_(): Couldn't open file for reading '%s'", filename);
+    }
+    data = mf.data;
+    size = mf.size;
+  } else if (TYPEOF(x_) == RAWSXP) {
+    data = RAW(x_);
+    size = (size_t)Rf_xlength(x_);
+  } else if (TYPEOF(x_) == STRSXP && Rf_length(x_) == 1) {
+    data = (const uint8_t *)CHAR(STRING_ELT(x_, 0));
+    size = strlen((const char *)data);
+  } else {
+    Rf_error("blake2b_(): 'x' must be a raw vector or a string");
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Hash
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  uint8_t hash[64];
+  
+  if (leaves == 1) {
+    crypto_blake2b_keyed(hash, (size_t)hash_size, key, key_size, data, size);
+  } else {
+    blake2b_tree t = {
+      .data      = data,
+      .size      = size,
+      .key       = key,
+      .key_size  = key_size,
+      .hash_size = (size_t)hash_size,
+      .leaves    = (size_t)leaves
+    };
+    parallel_for(t.leaves, threads, blake2b_leaf, &t);
+    blake2b_root(&t, hash);
+  }
+  
+  mapfile_close(&mf);
+  
+  SEXP res_ = PROTECT(wrap_bytes_for_return(hash, (size_t)hash_size, type_));
+  crypto_wipe(hash, sizeof(hash));
+  UNPROTECT(1);
+  return res_;
+}
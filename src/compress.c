@@ -0,0 +1,458 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <zlib.h>
+#include <bzlib.h>
+#include <lzma.h>
+
+#include "monocypher.h"
+#include "compress.h"
+#include "parallel.h"
+
+// Not using the R API in this file. All functions return 0 on success or
+// -1 on failure with a message in 'err'.  The caller is responsible for
+// raising any R error after tidying up.
+
+#define ZBLOCK_XZ_PRESET LZMA_PRESET_DEFAULT
+
+static void store32(uint8_t *p, uint32_t x) {
+  p[0] = (uint8_t)(x      );
+  p[1] = (uint8_t)(x >>  8);
+  p[2] = (uint8_t)(x >> 16);
+  p[3] = (uint8_t)(x >> 24);
+}
+
+static uint32_t load32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Codec from the name used by memCompress().  0 for 'none', -1 if unknown
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int zblock_codec(const char *name) {
+  if (strcmp(name, "none" ) == 0) return 0;
+  if (strcmp(name, "gzip" ) == 0) return ZBLOCK_CODEC_GZIP;
+  if (strcmp(name, "bzip2") == 0) return ZBLOCK_CODEC_BZIP2;
+  if (strcmp(name, "xz"   ) == 0) return ZBLOCK_CODEC_XZ;
+  return -1;
+}
+
+
+int zblock_is_zblock(const uint8_t *buf, size_t len) {
+  return len >= 4 && memcmp(buf, ZBLOCK_MAGIC, 4) == 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Largest possible compressed size of 'n' bytes
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t block_bound(int codec, size_t n) {
+  switch (codec) {
+  case ZBLOCK_CODEC_GZIP : return (size_t)compressBound((uLong)n);
+  case ZBLOCK_CODEC_BZIP2: return n + n / 100 + 600;
+  case ZBLOCK_CODEC_XZ   : return lzma_stream_buffer_bound(n);
+  }
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress a single block.  Levels match memCompress(), except that xz
+// uses the default preset (6) rather than 9e.  Preset 9 needs a 64 MB
+// dictionary (and ~700 MB to compress) per thread, which is wasted on
+// blocks of a few MB.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int compress_block(int codec, const uint8_t *src, size_t n, uint8_t *dst, size_t *dst_len) {
+  switch (codec) {
+  case ZBLOCK_CODEC_GZIP: {
+    uLongf len = (uLongf)*dst_len;
+    if (compress2(dst, &len, src, (uLong)n, Z_DEFAULT_COMPRESSION) != Z_OK) return -1;
+    *dst_len = (size_t)len;
+    return 0;
+  }
+  case ZBLOCK_CODEC_BZIP2: {
+    unsigned int len = (unsigned int)*dst_len;
+    if (BZ2_bzBuffToBuffCompress((char *)dst, &len, (char *)src, (unsigned int)n, 9, 0, 0) != BZ_OK) return -1;
+    *dst_len = (size_t)len;
+    return 0;
+  }
+  case ZBLOCK_CODEC_XZ: {
+    size_t pos = 0;
+    if (lzma_easy_buffer_encode(ZBLOCK_XZ_PRESET, LZMA_CHECK_CRC32, NULL, src, n, dst, &pos, *dst_len) != LZMA_OK) return -1;
+    *dst_len = pos;
+    return 0;
+  }
+  }
+  return -1;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress a single block, which must give exactly 'raw_len' bytes
+//
+// xz may use no more memory than decoding a block written by 
+// compress_block() needs (about 8 MB for preset 6), so a block declaring a 
+// larger dictionary fails rather than allocating it
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int decompress_block(int codec, const uint8_t *src, size_t n, uint8_t *dst, size_t raw_len) {
+  switch (codec) {
+  case ZBLOCK_CODEC_GZIP: {
+    uLongf len = (uLongf)raw_len;
+    if (uncompress(dst, &len, src, (uLong)n) != Z_OK) return -1;
+    return len == raw_len ? 0 : -1;
+  }
+  case ZBLOCK_CODEC_BZIP2: {
+    unsigned int len = (unsigned int)raw_len;
+    if (BZ2_bzBuffToBuffDecompress((char *)dst, &len, (char *)src, (unsigned int)n, 0, 0) != BZ_OK) return -1;
+    return len == raw_len ? 0 : -1;
+  }
+  case ZBLOCK_CODEC_XZ: {
+    uint64_t memlimit = lzma_easy_decoder_memusage(ZBLOCK_XZ_PRESET);
+    size_t in_pos = 0, out_pos = 0;
+    if (lzma_stream_buffer_decode(&memlimit, 0, NULL, src, &in_pos, n, dst, &out_pos, raw_len) != LZMA_OK) return -1;
+    return in_pos == n && out_pos == raw_len ? 0 : -1;
+  }
+  }
+  return -1;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress one block of a batch.  Called from worker threads.
+// Each output slot is [raw_len] [comp_len] [data]
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void compress_job(void *arg, size_t i) {
+  zblock_writer *w = (zblock_writer *)arg;
+  size_t   off  = i * w->block_size;
+  size_t   n    = w->in_len - off < w->block_size ? w->in_len - off : w->block_size;
+  uint8_t *slot = w->out + i * (ZBLOCK_BLOCKHEADER + w->bound);
+  size_t   len  = w->bound;
+
+  w->status[i] = compress_block(w->codec, w->in + off, n, slot + ZBLOCK_BLOCKHEADER, &len);
+  store32(slot    , (uint32_t)n);
+  store32(slot + 4, (uint32_t)len);
+  w->out_len[i] = ZBLOCK_BLOCKHEADER + len;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Initialise a writer and send the header to the sink
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int zblock_writer_init(zblock_writer *w, int codec, size_t block_size, int nthreads,
+                       zblock_sink sink, void *sink_ctx) {
+  memset(w, 0, sizeof(zblock_writer));
+  w->sink     = sink;
+  w->sink_ctx = sink_ctx;
+
+  if (codec < ZBLOCK_CODEC_GZIP || codec > ZBLOCK_CODEC_XZ) {
+    w->err = "unsupported compression codec";
+    return -1;
+  }
+  if (block_size == 0 || block_size > ZBLOCK_MAXSIZE) {
+    w->err = "invalid block size";
+    return -1;
+  }
+
+  w->codec      = codec;
+  w->nthreads   = nthreads < 1 ? 1 : nthreads;
+  w->nbatch     = (size_t)w->nthreads;
+  w->block_size = block_size;
+  w->bound      = block_bound(codec, block_size);
+
+  w->in      = malloc(w->nbatch * block_size);
+  w->out     = malloc(w->nbatch * (ZBLOCK_BLOCKHEADER + w->bound));
+  w->out_len = calloc(w->nbatch, sizeof(size_t));
+  w->status  = calloc(w->nbatch, sizeof(int));
+  if (w->in == NULL || w->out == NULL || w->out_len == NULL || w->status == NULL) {
+    w->err = "couldn't allocate compression buffers";
+    return -1;
+  }
+
+  uint8_t header[ZBLOCK_HEADERSIZE] = {0};
+  memcpy(header, ZBLOCK_MAGIC, 4);
+  header[4] = ZBLOCK_VERSION;
+  header[5] = (uint8_t)codec;
+  store32(header + 8, (uint32_t)block_size);
+
+  if (w->sink(w->sink_ctx, header, ZBLOCK_HEADERSIZE) < 0) {
+    w->err = "couldn't write compressed data";
+    return -1;
+  }
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress the waiting blocks in parallel, then send them to the sink in order
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int flush_batch(zblock_writer *w) {
+  if (w->in_len == 0) return 0;
+
+  size_t nblocks = (w->in_len - 1) / w->block_size + 1;
+  parallel_for(nblocks, w->nthreads, compress_job, w);
+
+  for (size_t i = 0; i < nblocks; i++) {
+    if (w->status[i] != 0) {
+      w->err = "compression failed";
+      return -1;
+    }
+  }
+
+  for (size_t i = 0; i < nblocks; i++) {
+    const uint8_t *slot = w->out + i * (ZBLOCK_BLOCKHEADER + w->bound);
+    if (w->sink(w->sink_ctx, slot, w->out_len[i]) < 0) {
+      w->err = "couldn't write compressed data";
+      return -1;
+    }
+  }
+
+  w->in_len = 0;
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Add data.  Blocks are compressed once a full batch is waiting.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int zblock_writer_update(zblock_writer *w, const uint8_t *data, size_t n) {
+  size_t batch = w->nbatch * w->block_size;
+
+  while (n > 0) {
+    size_t m = batch - w->in_len;
+    if (m > n) m = n;
+    memcpy(w->in + w->in_len, data, m);
+    w->in_len += m;
+    data      += m;
+    n         -= m;
+
+    if (w->in_len == batch && flush_batch(w) < 0) return -1;
+  }
+
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress any remaining data and end with an empty block
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int zblock_writer_final(zblock_writer *w) {
+  if (flush_batch(w) < 0) return -1;
+
+  uint8_t end[ZBLOCK_BLOCKHEADER] = {0};
+  if (w->sink(w->sink_ctx, end, ZBLOCK_BLOCKHEADER) < 0) {
+    w->err = "couldn't write compressed data";
+    return -1;
+  }
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Wipe and free the writer
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void zblock_writer_free(zblock_writer *w) {
+  if (w->in != NULL) {
+    crypto_wipe(w->in, w->nbatch * w->block_size);
+    free(w->in);
+  }
+  if (w->out != NULL) {
+    crypto_wipe(w->out, w->nbatch * (ZBLOCK_BLOCKHEADER + w->bound));
+    free(w->out);
+  }
+  free(w->out_len);
+  free(w->status);
+  w->in      = NULL;
+  w->out     = NULL;
+  w->out_len = NULL;
+  w->status  = NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decompress one block of a batch.  Called from worker threads.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void decompress_job(void *arg, size_t i) {
+  zblock_reader *r = (zblock_reader *)arg;
+  r->status[i] = decompress_block(r->codec, r->in + i * r->bound, r->in_len[i],
+                                  r->out + i * r->block_size, r->out_len[i]);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Initialise a reader and parse the header from the source
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int zblock_reader_init(zblock_reader *r, int nthreads, zblock_source source, void *source_ctx) {
+  memset(r, 0, sizeof(zblock_reader));
+  r->source     = source;
+  r->source_ctx = source_ctx;
+
+  uint8_t header[ZBLOCK_HEADERSIZE];
+  if (r->source(r->source_ctx, header, ZBLOCK_HEADERSIZE) < 0) {
+    r->err = "couldn't read compressed data";
+    return -1;
+  }
+  if (!zblock_is_zblock(header, ZBLOCK_HEADERSIZE)) {
+    r->err = "not block compressed data";
+    return -1;
+  }
+  if (header[4] != ZBLOCK_VERSION) {
+    r->err = "unsupported block compression version";
+    return -1;
+  }
+  if (header[5] < ZBLOCK_CODEC_GZIP || header[5] > ZBLOCK_CODEC_XZ) {
+    r->err = "unsupported compression codec";
+    return -1;
+  }
+  size_t block_size = load32(header + 8);
+  if (block_size == 0 || block_size > ZBLOCK_MAXSIZE) {
+    r->err = "invalid block size";
+    return -1;
+  }
+
+  r->codec      = header[5];
+  r->nthreads   = nthreads < 1 ? 1 : nthreads;
+  r->nbatch     = (size_t)r->nthreads;
+  r->block_size = block_size;
+  r->bound      = block_bound(r->codec, block_size);
+
+  r->in      = malloc(r->nbatch * r->bound);
+  r->in_len  = calloc(r->nbatch, sizeof(size_t));
+  r->out     = malloc(r->nbatch * block_size);
+  r->out_len = calloc(r->nbatch, sizeof(size_t));
+  r->status  = calloc(r->nbatch, sizeof(int));
+  if (r->in == NULL || r->in_len == NULL || r->out == NULL ||
+      r->out_len == NULL || r->status == NULL) {
+    r->err = "couldn't allocate compression buffers";
+    return -1;
+  }
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read the next batch of blocks from the source and decompress them in
+// parallel.  Stops early at the final empty block.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int fill_batch(zblock_reader *r) {
+  size_t nblocks = 0;
+
+  while (nblocks < r->nbatch && !r->done) {
+    uint8_t header[ZBLOCK_BLOCKHEADER];
+    if (r->source(r->source_ctx, header, ZBLOCK_BLOCKHEADER) < 0) {
+      r->err = "couldn't read compressed data";
+      return -1;
+    }
+    size_t raw_len  = load32(header);
+    size_t comp_len = load32(header + 4);
+    if (raw_len == 0 && comp_len == 0) {
+      r->done = 1;
+      break;
+    }
+    if (raw_len == 0 || raw_len > r->block_size || comp_len == 0 || comp_len > r->bound) {
+      r->err = "corrupt block header";
+      return -1;
+    }
+    if (r->source(r->source_ctx, r->in + nblocks * r->bound, comp_len) < 0) {
+      r->err = "couldn't read compressed data";
+      return -1;
+    }
+    r->in_len [nblocks] = comp_len;
+    r->out_len[nblocks] = raw_len;
+    nblocks++;
+  }
+
+  parallel_for(nblocks, r->nthreads, decompress_job, r);
+  for (size_t i = 0; i < nblocks; i++) {
+    if (r->status[i] != 0) {
+      r->err = "decompression failed";
+      return -1;
+    }
+  }
+
+  r->nblocks   = nblocks;
+  r->block_idx = 0;
+  r->block_pos = 0;
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read 'n' bytes of decompressed data into 'dst'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int zblock_reader_read(zblock_reader *r, uint8_t *dst, size_t n) {
+
+  while (n > 0) {
+    if (r->block_idx < r->nblocks) {
+      size_t avail = r->out_len[r->block_idx] - r->block_pos;
+      size_t m = avail < n ? avail : n;
+      memcpy(dst, r->out + r->block_idx * r->block_size + r->block_pos, m);
+      r->block_pos += m;
+      dst          += m;
+      n            -= m;
+      if (r->block_pos == r->out_len[r->block_idx]) {
+        r->block_idx++;
+        r->block_pos = 0;
+      }
+      continue;
+    }
+
+    if (r->done) {
+      r->err = "read past end of compressed data";
+      return -1;
+    }
+    if (fill_batch(r) < 0) return -1;
+  }
+
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Check that all data has been consumed, up to and including the final
+// empty block
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int zblock_reader_finish(zblock_reader *r) {
+  if (r->block_idx < r->nblocks) {
+    r->err = "unread data at end of compressed data";
+    return -1;
+  }
+  if (!r->done) {
+    uint8_t header[ZBLOCK_BLOCKHEADER];
+    if (r->source(r->source_ctx, header, ZBLOCK_BLOCKHEADER) < 0) {
+      r->err = "couldn't read compressed data";
+      return -1;
+    }
+    if (load32(header) != 0 || load32(header + 4) != 0) {
+      r->err = "unread data at end of compressed data";
+      return -1;
+    }
+    r->done = 1;
+  }
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Wipe and free the reader
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void zblock_reader_free(zblock_reader *r) {
+  if (r->in != NULL) {
+    crypto_wipe(r->in, r->nbatch * r->bound);
+    free(r->in);
+  }
+  if (r->out != NULL) {
+    crypto_wipe(r->out, r->nbatch * r->block_size);
+    free(r->out);
+  }
+  free(r->in_len);
+  free(r->out_len);
+  free(r->status);
+  r->in      = NULL;
+  r->in_len  = NULL;
+  r->out     = NULL;
+  r->out_len = NULL;
+  r->status  = NULL;
+}
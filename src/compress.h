@@ -0,0 +1,88 @@
+#ifndef RMONOCYPHER_COMPRESS_H
+#define RMONOCYPHER_COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Block compressed format
+//
+// [header] [raw_len, comp_len, data] [raw_len, comp_len, data] ... [0, 0]
+//
+// header   = [magic 4] [version 1] [codec 1] [reserved 2] [block_size 4]
+// raw_len  = 4-byte little-endian size of the block once decompressed.
+//            Every block except the last holds exactly 'block_size' bytes.
+// comp_len = 4-byte little-endian size of the compressed 'data'
+//
+// Each block is compressed independently, so a batch of blocks can be
+// compressed or decompressed in parallel.  The block headers form an index
+// which is written as the data is produced, so neither side needs to hold
+// all the data.  The stream ends with an empty block.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define ZBLOCK_MAGIC       "\x89RMZ"
+#define ZBLOCK_VERSION     1
+#define ZBLOCK_HEADERSIZE  12
+#define ZBLOCK_BLOCKHEADER  8
+#define ZBLOCK_SIZE        (4 * 1024 * 1024)
+#define ZBLOCK_MAXSIZE     (64 * 1024 * 1024)
+
+#define ZBLOCK_CODEC_GZIP  1
+#define ZBLOCK_CODEC_BZIP2 2
+#define ZBLOCK_CODEC_XZ    3
+
+// Where compressed data goes to, and uncompressed data comes from.
+// Return 0 on success, -1 on failure
+typedef int (*zblock_sink)  (void *ctx, const uint8_t *data, size_t n);
+typedef int (*zblock_source)(void *ctx, uint8_t *data, size_t n);
+
+typedef struct {
+  int      codec;
+  int      nthreads;
+  size_t   block_size;
+  size_t   bound;       // maximum compressed size of a block
+  size_t   nbatch;      // number of blocks compressed together
+  uint8_t *in;          // plain data waiting to be compressed. 'nbatch' blocks
+  size_t   in_len;
+  uint8_t *out;         // compressed blocks. 'nbatch' x 'bound'
+  size_t  *out_len;
+  int     *status;
+  zblock_sink sink;
+  void    *sink_ctx;
+  const char *err;
+} zblock_writer;
+
+typedef struct {
+  int      codec;
+  int      nthreads;
+  size_t   block_size;
+  size_t   bound;
+  size_t   nbatch;      // maximum number of blocks decompressed together
+  uint8_t *in;          // compressed blocks. 'nbatch' x 'bound'
+  size_t  *in_len;
+  uint8_t *out;         // decompressed blocks. 'nbatch' x 'block_size'
+  size_t  *out_len;
+  size_t   nblocks;     // number of blocks in 'out'
+  size_t   block_idx;   // block in 'out' currently being read
+  size_t   block_pos;
+  int     *status;
+  int      done;        // has the final empty block been read?
+  zblock_source source;
+  void    *source_ctx;
+  const char *err;
+} zblock_reader;
+
+int  zblock_codec(const char *name);
+int  zblock_is_zblock(const uint8_t *buf, size_t len);
+
+int  zblock_writer_init(zblock_writer *w, int codec, size_t block_size, int nthreads,
+                        zblock_sink sink, void *sink_ctx);
+int  zblock_writer_update(zblock_writer *w, const uint8_t *data, size_t n);
+int  zblock_writer_final(zblock_writer *w);
+void zblock_writer_free(zblock_writer *w);
+
+int  zblock_reader_init(zblock_reader *r, int nthreads, zblock_source source, void *source_ctx);
+int  zblock_reader_read(zblock_reader *r, uint8_t *dst, size_t n);
+int  zblock_reader_finish(zblock_reader *r);
+void zblock_reader_free(zblock_reader *r);
+
+#endif
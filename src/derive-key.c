@@ -0,0 +1,106 @@
+#define R_NO_REMAP
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include "monocypher.h"
+#include "utils.h"
+#include "argon2.h"
+#include "secmem.h"
+#include "derive-key.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Key handles
+//
+// An external pointer to a 32-byte key held in locked memory (secmem.c).
+// The key is never copied into an R vector.  The memory is wiped and 
+// released by the finalizer when the handle is garbage collected.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define KEYSIZE 32
+
+static SEXP key_tag(void) {
+  return Rf_install("rmonocypher_key");
+}
+
+
+static void key_finalizer(SEXP key_) {
+  uint8_t *key = (uint8_t *)R_ExternalPtrAddr(key_);
+  if (key != NULL) {
+    secmem_free(key, KEYSIZE);
+    R_ClearExternalPtr(key_);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Is this a key handle created by derive_key_()?
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int is_key_handle(SEXP key_) {
+  return TYPEOF(key_) == EXTPTRSXP && R_ExternalPtrTag(key_) == key_tag();
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Copy the key out of a key handle
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void unpack_key_handle(SEXP key_, uint8_t key[32]) {
+  uint8_t *src = (uint8_t *)R_ExternalPtrAddr(key_);
+  if (src == NULL) {
+    // e.g. the handle was saved and then reloaded in a new session
+    Rf_error("unpack_key(): Key handle is no longer valid");
+  }
+  memcpy(key, src, KEYSIZE);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Derive a key from a password and return a handle to it
+//
+// @param password_ password
+// @param salt_ 16 byte salt. Or hex string. Or shorter string to be expanded.
+//        Or NULL to derive the salt from the password, giving the same key 
+//        as unpack_key() does for a text key.
+// @param kdf_ Argon2 parameters. NULL or list created by kdf_params()
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP derive_key_(SEXP password_, SEXP salt_, SEXP kdf_) {
+  
+  if (TYPEOF(password_) != STRSXP || Rf_length(password_) != 1) {
+    Rf_error("derive_key_(): 'password' must be a single string");
+  }
+  if (strlen(CHAR(STRING_ELT(password_, 0))) == 0) {
+    Rf_error("derive_key_(): 'password' must not be empty");
+  }
+  
+  argon_params params;
+  unpack_argon_params(kdf_, &params);
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Derive the key before allocating locked memory, so an error here 
+  // doesn't leak it.  Uses the key cache if enabled.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  uint8_t key[KEYSIZE];
+  password_to_key(password_, salt_, &params, key);
+  
+  uint8_t *secret = (uint8_t *)secmem_alloc(KEYSIZE);
+  if (secret == NULL) {
+    crypto_wipe(key, sizeof(key));
+    Rf_error("derive_key_(): Couldn't allocate locked memory for key");
+  }
+  memcpy(secret, key, KEYSIZE);
+  crypto_wipe(key, sizeof(key));
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Wrap in an external pointer with a finalizer which wipes the key
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  SEXP key_ = PROTECT(R_MakeExternalPtr(secret, key_tag(), R_NilValue));
+  R_RegisterCFinalizerEx(key_, key_finalizer, TRUE);
+  Rf_setAttrib(key_, R_ClassSymbol, Rf_mkString("rmonocypher_key"));
+  
+  UNPROTECT(1);
+  return key_;
+}
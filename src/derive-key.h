@@ -0,0 +1,4 @@
+#include <stdint.h>
+
+int is_key_handle(SEXP key_);
+void unpack_key_handle(SEXP key_, uint8_t key[32]);
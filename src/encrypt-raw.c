@@ -13,12 +13,85 @@
 #include "utils.h"
 #include "argon2.h"
 #include "rbyte.h"
+#include "stream.h"
+#include "mapfile.h"
+#include "parallel.h"
 
 
 #define KEYSIZE   32
 #define NONCESIZE 24
 #define MACSIZE   16
 
+#define NONCEBATCH 10  // nonces drawn together when encrypting a batch
+
+SEXP decrypt_stream_(SEXP src_, SEXP key_, SEXP additional_data_, SEXP threads_, SEXP kdf_);
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Encrypt a single message
+//
+// @param dst destination. NONCESIZE + MACSIZE + 'payload_size' bytes
+//        [nonce] [mac] [cipher text]
+// @param nonce random nonce.  Must never be reused with the same key
+// @param plain_text 'payload_size' bytes
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void seal_message(uint8_t *dst, const uint8_t nonce[NONCESIZE],
+                         const uint8_t *plain_text, size_t payload_size,
+                         const uint8_t key[32], const uint8_t *ad, size_t ad_len) {
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Encryption Context
+  // void crypto_aead_init_x(crypto_aead_ctx *ctx, const uint8_t key[32], const uint8_t nonce[24]);
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  crypto_aead_ctx ctx;
+  crypto_aead_init_x(&ctx, key, nonce);
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Initialise MAC
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  uint8_t mac[MACSIZE] = { 0 };
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Encryption
+  //   Leave room at start of buffer for nonce, payload size and mac
+  // void
+  // crypto_aead_write(
+  //    crypto_aead_ctx *ctx, 
+  //    uint8_t *cipher_text, 
+  //    uint8_t mac[16], 
+  //    const uint8_t *ad, size_t ad_size, 
+  //    const uint8_t *plain_text, size_t text_size
+  // );
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  crypto_aead_write(
+    &ctx, 
+    dst + NONCESIZE + MACSIZE, 
+    mac,
+    ad, ad_len,
+    plain_text, payload_size
+  );
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Record nonce and mac at start of data
+  // [nonce] [len, mac, data] [len, mac, data] 
+  // where 'len' is the size of the encrypted data (not including 'len' or 'mac')
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  memcpy(dst            , nonce,  NONCESIZE);
+  memcpy(dst + NONCESIZE,   mac,    MACSIZE);
+  
+  crypto_wipe(&ctx, sizeof(ctx));
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A message starts with its nonce.  A nonce which starts with the stream 
+// magic is drawn again, so a message is never mistaken for a stream
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void redraw_ambiguous_nonce(uint8_t nonce[NONCESIZE]) {
+  while (stream_is_stream(nonce, NONCESIZE)) {
+    rbyte(nonce, NONCESIZE);
+  }
+}
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -39,8 +112,13 @@ SEXP encrypt_(SEXP x_, SEXP key_, SEXP additional_data_) {
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Key
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // This format has nowhere to record the key derivation version, so 
+  // passwords are always handled the original way
+  argon_params params;
+  argon_default_params(&params);
+  params.version = ARGON2_KDF_LEGACY;
   uint8_t key[32];
-  unpack_key(key_, key);
+  unpack_key(key_, &params, key);
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Plain Text
@@ -48,24 +126,6 @@ SEXP encrypt_(SEXP x_, SEXP key_, SEXP additional_data_) {
   uint8_t *plain_text = RAW(x_);
   size_t payload_size = (size_t)Rf_xlength(x_);
   
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Nonce
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  uint8_t nonce[NONCESIZE];
-  rbyte(nonce, NONCESIZE);
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Encryption Context
-  // void crypto_aead_init_x(crypto_aead_ctx *ctx, const uint8_t key[32], const uint8_t nonce[24]);
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  crypto_aead_ctx ctx;
-  crypto_aead_init_x(&ctx, key, nonce);
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Initialise MAC
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  uint8_t mac[MACSIZE] = { 0 };
-  
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Cipher Text
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -100,38 +160,21 @@ SEXP encrypt_(SEXP x_, SEXP key_, SEXP additional_data_) {
   }
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Encryption
-  //   Leave room at start of buffer for nonce, payload size and mac
-  // void
-  // crypto_aead_write(
-  //    crypto_aead_ctx *ctx, 
-  //    uint8_t *cipher_text, 
-  //    uint8_t mac[16], 
-  //    const uint8_t *ad, size_t ad_size, 
-  //    const uint8_t *plain_text, size_t text_size
-  // );
+  // Nonce
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  crypto_aead_write(
-    &ctx, 
-    cipher_text + NONCESIZE + MACSIZE, 
-    mac,
-    ad, ad_len,
-    plain_text, payload_size
-  );
+  uint8_t nonce[NONCESIZE];
+  rbyte(nonce, NONCESIZE);
+  redraw_ambiguous_nonce(nonce);
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Record nonce and mac at start of data
-  // [nonce] [len, mac, data] [len, mac, data] 
-  // where 'len' is the size of the encrypted data (not including 'len' or 'mac')
+  // Encryption
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  memcpy(cipher_text            , nonce,  NONCESIZE);
-  memcpy(cipher_text + NONCESIZE,   mac,    MACSIZE);
+  seal_message(cipher_text, nonce, plain_text, payload_size, key, ad, ad_len);
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Tidy and return encrypted text
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   crypto_wipe(key, sizeof(key));
-  crypto_wipe(&ctx, sizeof(ctx));
   UNPROTECT(1);
   return cipher_text_;
 }
@@ -139,99 +182,66 @@ SEXP encrypt_(SEXP x_, SEXP key_, SEXP additional_data_) {
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// Decrypt data
+// Unpack the key and additional data for decrypting a single message
 //
-// @param src_ raw vector containing encrypted data
-// @param key_ 32 bytes.  Raw vector. Or hex string. Or password to feed to 
-//        argon2()
-// @param type_ 'raw' or "chr"?
-// @param additional_data_ data used for message authentication, but not
-//        encrypted or included with encrypted output
+// Additional data is checked first, so nothing needs wiping if it is invalid
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-SEXP decrypt_(SEXP src_, SEXP key_, SEXP additional_data_) {
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Position within cipher text
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t ntotal = (size_t)Rf_xlength(src_);
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Cipher text
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  uint8_t *cipher_text = RAW(src_);
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // frameheader - get payload size for this frame
-  //   payload size is just the encrypted data.  It does not include MAC
-  //     or the bytes indicating the length.
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  size_t payload_size = ntotal - NONCESIZE - MACSIZE;
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // plaintext buffer for decrypted output
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  SEXP res_ = PROTECT(Rf_allocVector(RAWSXP, (R_xlen_t)payload_size));
-  uint8_t *plaintext = (uint8_t *)RAW(res_);
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Key
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  uint8_t key[32];
-  unpack_key(key_, key);
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Nonce
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  uint8_t nonce[NONCESIZE];
-  memcpy(nonce, cipher_text, NONCESIZE);
-  cipher_text += NONCESIZE;
-  
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // context
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  crypto_aead_ctx ctx;
-  crypto_aead_init_x(&ctx, key, nonce);
+static void unpack_message_args(SEXP key_, SEXP additional_data_, SEXP kdf_,
+                                uint8_t key[32], uint8_t **ad, size_t *ad_len) {
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // For this package, additional data only applies to first message in 
   // a stream of messages
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  uint8_t *ad = NULL;
-  size_t ad_len = 0;
+  *ad = NULL;
+  *ad_len = 0;
   if (Rf_isNull(additional_data_)) {
     // Do nothing
   } else if (TYPEOF(additional_data_) == RAWSXP) {
     if (Rf_length(additional_data_) > 0) {
-      ad = RAW(additional_data_);
-      ad_len = (size_t)Rf_xlength(additional_data_); 
+      *ad = RAW(additional_data_);
+      *ad_len = (size_t)Rf_xlength(additional_data_); 
     } else {
-      crypto_wipe(key, sizeof(key));
-      crypto_wipe(&ctx, sizeof(ctx));
       Rf_error("decrypt_(): 'additional_data' cannot be empty raw vector");
     }
   } else if (TYPEOF(additional_data_) == STRSXP) {
     const char *ad_string = CHAR(STRING_ELT(additional_data_, 0));
     if (strlen(ad_string) > 0) {
-      ad = (uint8_t *)ad_string;
-      ad_len = strlen(ad_string);
+      *ad = (uint8_t *)ad_string;
+      *ad_len = strlen(ad_string);
     } else {
-      crypto_wipe(key, sizeof(key));
-      crypto_wipe(&ctx, sizeof(ctx));
       Rf_error("decrypt_(): 'additional_data' cannot be empty string");
     }
   } else {
-    crypto_wipe(key, sizeof(key));
-    crypto_wipe(&ctx, sizeof(ctx));
     Rf_error("decrypt_(): 'additional_data' must be raw vector or string.");
   }
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // frameheader - get MAC
+  // Key
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  uint8_t mac[MACSIZE];
-  memcpy(mac, cipher_text, MACSIZE);
-  cipher_text += MACSIZE;
+  argon_params params;
+  unpack_argon_params(kdf_, &params);
+  params.version = ARGON2_KDF_LEGACY;
+  unpack_key(key_, &params, key);
+}
+
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decrypt a single message: [nonce] [mac] [cipher text]
+//
+// Decryption happens while authenticating, so on failure crypto_aead_read()
+// has already wiped the partially decrypted 'plaintext'
+//
+// @param plaintext destination. 'payload_size' bytes
+// @param src encrypted message. NONCESIZE + MACSIZE + 'payload_size' bytes
+// @return 0 on success, -1 if authentication failed
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int open_message(uint8_t *plaintext, const uint8_t *src, size_t payload_size,
+                        const uint8_t key[32], const uint8_t *ad, size_t ad_len) {
+  
+  crypto_aead_ctx ctx;
+  crypto_aead_init_x(&ctx, key, src);
+  
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Decrypt stream
   // crypto_aead_read(
@@ -243,29 +253,410 @@ SEXP decrypt_(SEXP src_, SEXP key_, SEXP additional_data_) {
   //    size_t text_size
   // );
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  int decrypt_status = crypto_aead_read(
+  int status = crypto_aead_read(
     &ctx, 
     plaintext, 
-    mac,
+    src + NONCESIZE,
     ad, ad_len,
-    cipher_text, payload_size
+    src + NONCESIZE + MACSIZE, payload_size
   );
   
-  crypto_wipe(key, sizeof(key));
   crypto_wipe(&ctx, sizeof(ctx));
+  return status;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decrypt a complete single message of 'ntotal' bytes into a new raw 
+// vector.  'key' is wiped
+//
+// @return raw vector, or NULL if authentication failed
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP message_to_raw(const uint8_t *src, size_t ntotal, uint8_t key[32],
+                           const uint8_t *ad, size_t ad_len) {
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // payload size is just the encrypted data.  It does not include MAC
+  // or the nonce
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  size_t payload_size = ntotal - NONCESIZE - MACSIZE;
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Sanity check it went OK
+  // Decrypt directly into the result
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (decrypt_status < 0) {
+  SEXP res_ = PROTECT(Rf_allocVector(RAWSXP, (R_xlen_t)payload_size));
+  int status = open_message(RAW(res_), src, payload_size, key, ad, ad_len);
+  crypto_wipe(key, 32);
+  
+  UNPROTECT(1);
+  return status < 0 ? NULL : res_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decrypt data which was encrypted as a single message i.e. by encrypt_()
+//
+// @param src_ raw vector containing encrypted data
+// @param key_ 32 bytes.  Raw vector. Or hex string. Or password to feed to 
+//        argon2()
+// @param additional_data_ data used for message authentication, but not
+//        encrypted or included with encrypted output
+// @param kdf_ Argon2 parameters used if 'key_' is a password. NULL for 
+//        the defaults.  The legacy key derivation version is always used, 
+//        as for encrypt_()
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP decrypt_message(SEXP src_, SEXP key_, SEXP additional_data_, SEXP kdf_) {
+  
+  size_t ntotal = (size_t)Rf_xlength(src_);
+  if (ntotal < NONCESIZE + MACSIZE) {
+    Rf_error("decrypt_(): 'src' is too short to contain encrypted data");
+  }
+  
+  uint8_t key[KEYSIZE];
+  uint8_t *ad = NULL;
+  size_t ad_len = 0;
+  unpack_message_args(key_, additional_data_, kdf_, key, &ad, &ad_len);
+  
+  SEXP res_ = message_to_raw(RAW(src_), ntotal, key, ad, ad_len);
+  if (res_ == NULL) {
     Rf_error("decrypt_(): Decryption failed\n");
   } 
+  return res_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// As decrypt_message(), but for a file.
+//
+// The file is mapped into memory and decrypted straight from the mapping
+// into the result, rather than first being read into a raw vector.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP decrypt_message_file(const char *filename, SEXP key_, SEXP additional_data_, SEXP kdf_) {
+  
+  uint8_t key[KEYSIZE];
+  uint8_t *ad = NULL;
+  size_t ad_len = 0;
+  unpack_message_args(key_, additional_data_, kdf_, key, &ad, &ad_len);
+  
+  mapped_file mf;
+  if (mapfile_open(&mf, filename) < 0) {
+    crypto_wipe(key, sizeof(key));
+    Rf_error("decrypt_(): Couldn't open file for reading '%s'", filename);
+  }
+  if (mf.size < NONCESIZE + MACSIZE) {
+    mapfile_close(&mf);
+    crypto_wipe(key, sizeof(key));
+    Rf_error("decrypt_(): 'src' is too short to contain encrypted data");
+  }
+  
+  SEXP res_ = message_to_raw(mf.data, mf.size, key, ad, ad_len);
+  mapfile_close(&mf);
+  
+  if (res_ == NULL) {
+    Rf_error("decrypt_(): Decryption failed\n");
+  } 
+  return res_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Try data which starts with the stream magic, but isn't a valid stream, 
+// as a single message.  Messages written before nonces starting with the 
+// magic were redrawn (see encrypt_()) can look like this.
+//
+// @param src_ raw vector.  Or NULL to read 'filename'
+// @return decrypted raw vector, or NULL if it isn't a valid message either
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP try_decrypt_message(SEXP src_, const char *filename, SEXP key_, 
+                         SEXP additional_data_, SEXP kdf_) {
+  
+  uint8_t key[KEYSIZE];
+  uint8_t *ad = NULL;
+  size_t ad_len = 0;
+  unpack_message_args(key_, additional_data_, kdf_, key, &ad, &ad_len);
+  
+  if (filename == NULL) {
+    size_t ntotal = (size_t)Rf_xlength(src_);
+    if (ntotal < NONCESIZE + MACSIZE) {
+      crypto_wipe(key, sizeof(key));
+      return NULL;
+    }
+    return message_to_raw(RAW(src_), ntotal, key, ad, ad_len);
+  }
+  
+  mapped_file mf;
+  if (mapfile_open(&mf, filename) < 0 || mf.size < NONCESIZE + MACSIZE) {
+    mapfile_close(&mf);
+    crypto_wipe(key, sizeof(key));
+    return NULL;
+  }
+  SEXP res_ = message_to_raw(mf.data, mf.size, key, ad, ad_len);
+  mapfile_close(&mf);
+  return res_;
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decrypt data
+//
+// Data written by encrypt() is a stream of chunks, otherwise the data
+// is a single message written by encrypt_()
+//
+// @param src_ raw vector containing encrypted data
+// @param key_ 32 bytes.  Raw vector. Or hex string. Or password to feed to 
+//        argon2()
+// @param additional_data_ data used for message authentication, but not
+//        encrypted or included with encrypted output
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP decrypt_(SEXP src_, SEXP key_, SEXP additional_data_) {
+  
+  if (TYPEOF(src_) != RAWSXP) {
+    Rf_error("decrypt_(): 'src' must be a raw vector");
+  }
+  
+  if (stream_is_stream(RAW(src_), (size_t)Rf_xlength(src_))) {
+    SEXP threads_ = PROTECT(Rf_ScalarInteger(1));
+    SEXP res_ = PROTECT(decrypt_stream_(src_, key_, additional_data_, threads_, R_NilValue));
+    UNPROTECT(2);
+    return res_;
+  }
+  
+  return decrypt_message(src_, key_, additional_data_, R_NilValue);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Batches of messages
+//
+// The key and additional data are unpacked once for the whole batch.  An
+// element which can't be encrypted/decrypted doesn't stop the batch. 
+// Its result is NULL, and its error message is recorded in the 'errors' 
+// attribute of the result (NA for elements which succeeded).  The attribute
+// is only added if at least one element failed.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP batch_init(SEXP x_, R_xlen_t n, SEXP *errors_) {
+  SEXP res_ = PROTECT(Rf_allocVector(VECSXP, n));
+  SEXP names_ = Rf_getAttrib(x_, R_NamesSymbol);
+  if (!Rf_isNull(names_)) {
+    Rf_setAttrib(res_, R_NamesSymbol, names_);
+  }
+  *errors_ = PROTECT(Rf_allocVector(STRSXP, n));
+  for (R_xlen_t i = 0; i < n; i++) {
+    SET_STRING_ELT(*errors_, i, NA_STRING);
+  }
+  UNPROTECT(2);
+  return res_;
+}
+
+static void batch_error(SEXP errors_, R_xlen_t i, const char *msg, int *nerrors) {
+  SET_STRING_ELT(errors_, i, Rf_mkChar(msg));
+  (*nerrors)++;
+}
+
+static void batch_final(SEXP res_, SEXP errors_, int nerrors) {
+  if (nerrors > 0) {
+    Rf_setAttrib(res_, Rf_install("errors"), errors_);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Encrypt each raw vector in a list as a single message (as encrypt_())
+//
+// @param x_ list of raw vectors
+// @param key_ 32 bytes.  Raw vector. Or hex string. Or password to feed to 
+//        argon2()
+// @param additional_data_ data used for message authentication of every
+//        element
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP encrypt_raw_batch_(SEXP x_, SEXP key_, SEXP additional_data_) {
+  
+  if (TYPEOF(x_) != VECSXP) {
+    Rf_error("encrypt_raw_batch_(): 'x' must be a list of raw vectors");
+  }
+  R_xlen_t n = Rf_xlength(x_);
+  
+  uint8_t *ad = NULL;
+  size_t ad_len = 0;
+  unpack_additional_data(additional_data_, &ad, &ad_len);
+  
+  SEXP errors_;
+  SEXP res_ = PROTECT(batch_init(x_, n, &errors_));
+  PROTECT(errors_);
+  int nerrors = 0;
+  
+  argon_params params;
+  argon_default_params(&params);
+  params.version = ARGON2_KDF_LEGACY;
+  uint8_t key[32];
+  unpack_key(key_, &params, key);
+  
+  // Nonces are drawn from the system RNG several at a time. Requests of up 
+  // to 256 bytes are always filled completely
+  uint8_t nonces[NONCEBATCH * NONCESIZE];
+  size_t nonce_idx = NONCEBATCH;
+  
+  for (R_xlen_t i = 0; i < n; i++) {
+    SEXP x_i = VECTOR_ELT(x_, i);
+    if (TYPEOF(x_i) != RAWSXP) {
+      batch_error(errors_, i, "'x' element must be a raw vector", &nerrors);
+      continue;
+    }
+    size_t payload_size = (size_t)Rf_xlength(x_i);
+    SEXP enc_ = Rf_allocVector(RAWSXP, (R_xlen_t)(payload_size + NONCESIZE + MACSIZE));
+    SET_VECTOR_ELT(res_, i, enc_);
+    if (nonce_idx == NONCEBATCH) {
+      rbyte(nonces, sizeof(nonces));
+      nonce_idx = 0;
+    }
+    uint8_t *nonce = nonces + NONCESIZE * nonce_idx++;
+    redraw_ambiguous_nonce(nonce);
+    seal_message(RAW(enc_), nonce, RAW(x_i), payload_size, key, ad, ad_len);
+  }
+  
+  crypto_wipe(key, sizeof(key));
+  batch_final(res_, errors_, nerrors);
+  UNPROTECT(2);
+  return res_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A message to be opened by a worker thread
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  const uint8_t *src;
+  uint8_t *dst;
+  size_t   payload_size;
+  int      status;
+  R_xlen_t idx;          // position in the list
+} batch_item;
+
+typedef struct {
+  batch_item *items;
+  const uint8_t *key;
+  const uint8_t *ad;
+  size_t ad_len;
+} batch_work;
+
+static void open_message_worker(void *arg, size_t i) {
+  batch_work *work = (batch_work *)arg;
+  batch_item *item = &work->items[i];
+  item->status = open_message(item->dst, item->src, item->payload_size,
+                              work->key, work->ad, work->ad_len);
+}
+
+// Largest messages first, so a big message isn't left until the end when
+// the other threads have nothing to do
+static int cmp_payload_size(const void *a, const void *b) {
+  size_t na = ((const batch_item *)a)->payload_size;
+  size_t nb = ((const batch_item *)b)->payload_size;
+  return (na < nb) - (na > nb);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decrypt each message in a list (as written by encrypt_())
+//
+// All results are allocated on the main thread first.  The messages are 
+// then opened by 'nthreads' threads, which don't touch the R API, each 
+// claiming the next message as it finishes the last.  Messages which fail
+// authentication have already been wiped by crypto_aead_read()
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP decrypt_batch(SEXP src_, SEXP key_, SEXP additional_data_, int nthreads,
+                          const char *caller) {
+  
+  if (TYPEOF(src_) != VECSXP) {
+    Rf_error("%s: 'src' must be a list of raw vectors", caller);
+  }
+  R_xlen_t n = Rf_xlength(src_);
+  
+  uint8_t *ad = NULL;
+  size_t ad_len = 0;
+  unpack_additional_data(additional_data_, &ad, &ad_len);
+  
+  SEXP errors_;
+  SEXP res_ = PROTECT(batch_init(src_, n, &errors_));
+  PROTECT(errors_);
+  int nerrors = 0;
   
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Tidy and return decrypted text
+  // Allocate the plain text for every valid message.  These only move to
+  // 'res_' once authenticated
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  UNPROTECT(1);
+  SEXP out_ = PROTECT(Rf_allocVector(VECSXP, n));
+  batch_item *items = (batch_item *)R_alloc((size_t)n, sizeof(batch_item));
+  size_t nitems = 0;
+  
+  for (R_xlen_t i = 0; i < n; i++) {
+    SEXP src_i = VECTOR_ELT(src_, i);
+    if (TYPEOF(src_i) != RAWSXP) {
+      batch_error(errors_, i, "'src' element must be a raw vector", &nerrors);
+      continue;
+    }
+    size_t ntotal = (size_t)Rf_xlength(src_i);
+    if (ntotal < NONCESIZE + MACSIZE) {
+      batch_error(errors_, i, "'src' element is too short to contain encrypted data", &nerrors);
+      continue;
+    }
+    size_t payload_size = ntotal - NONCESIZE - MACSIZE;
+    SEXP dec_ = Rf_allocVector(RAWSXP, (R_xlen_t)payload_size);
+    SET_VECTOR_ELT(out_, i, dec_);
+    items[nitems++] = (batch_item){RAW(src_i), RAW(dec_), payload_size, 0, i};
+  }
+  
+  if (nthreads > 1) {
+    qsort(items, nitems, sizeof(batch_item), cmp_payload_size);
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Key.  As for encrypt_(), passwords are always handled the original way
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  argon_params params;
+  argon_default_params(&params);
+  params.version = ARGON2_KDF_LEGACY;
+  uint8_t key[32];
+  unpack_key(key_, &params, key);
+  
+  batch_work work = { .items = items, .key = key, .ad = ad, .ad_len = ad_len };
+  parallel_for(nitems, nthreads, open_message_worker, &work);
+  crypto_wipe(key, sizeof(key));
+  
+  for (size_t j = 0; j < nitems; j++) {
+    if (items[j].status < 0) {
+      batch_error(errors_, items[j].idx, "Decryption failed", &nerrors);
+    } else {
+      SET_VECTOR_ELT(res_, items[j].idx, VECTOR_ELT(out_, items[j].idx));
+    }
+  }
+  
+  batch_final(res_, errors_, nerrors);
+  UNPROTECT(3);
   return res_;
 }
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decrypt each message in a list (as written by encrypt_())
+//
+// @param src_ list of raw vectors
+// @param key_ 32 bytes.  Raw vector. Or hex string. Or password to feed to 
+//        argon2()
+// @param additional_data_ data used for message authentication of every
+//        element
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP decrypt_raw_batch_(SEXP src_, SEXP key_, SEXP additional_data_) {
+  return decrypt_batch(src_, key_, additional_data_, 1, "decrypt_raw_batch_()");
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// As decrypt_raw_batch_(), with messages opened in parallel
+//
+// @param threads_ number of threads. NULL for one per CPU core
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP decrypt_raw_parallel_(SEXP src_, SEXP key_, SEXP additional_data_, SEXP threads_) {
+  int threads = Rf_isNull(threads_) ? parallel_ncores() : unpack_threads(threads_);
+  return decrypt_batch(src_, key_, additional_data_, threads, "decrypt_raw_parallel_()");
+}
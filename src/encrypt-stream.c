@@ -0,0 +1,386 @@
+
+#define R_NO_REMAP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include "monocypher.h"
+#include "utils.h"
+#include "rbyte.h"
+#include "stream.h"
+#include "mapfile.h"
+
+SEXP decrypt_message(SEXP src_, SEXP key_, SEXP additional_data_, SEXP kdf_);
+SEXP decrypt_message_file(const char *filename, SEXP key_, SEXP additional_data_, SEXP kdf_);
+SEXP try_decrypt_message(SEXP src_, const char *filename, SEXP key_, 
+                         SEXP additional_data_, SEXP kdf_);
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// What to record in the header of a new stream
+//
+// Key derivation version and parameters are only recorded when the key is
+// derived from a password here.  A raw key or key handle doesn't depend on 
+// them, so they are left as 0 ("not recorded").
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void stream_info_init(stream_info *info, int content, int codec, SEXP key_,
+                      const argon_params *params) {
+  memset(info, 0, sizeof(stream_info));
+  info->version       = STREAM_VERSION;
+  info->content       = content;
+  info->codec         = codec;
+  if (!key_is_password(key_)) {
+    return;
+  }
+  info->kdf_version   = params->version;
+  info->kdf_algorithm = params->algorithm;
+  info->kdf_blocks    = params->nb_blocks;
+  info->kdf_passes    = params->nb_passes;
+  info->kdf_lanes     = params->nb_lanes;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Use the key derivation parameters recorded in a stream header, in place
+// of those given by the caller.  Threads follow the number of lanes as 
+// described for argon_set_lanes().
+//
+// Version 1 headers always record the key derivation version.  Version 2
+// headers record nothing when the key wasn't a password, and then the 
+// caller's version is kept.
+//
+// The header isn't authenticated until the key has been derived, so the 
+// recorded memory and passes may not exceed the caller's.  Otherwise a
+// crafted header could make Argon2 run for hours or exhaust memory.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void use_recorded_params(const stream_info *info, SEXP key_, argon_params *params,
+                                const char *caller) {
+  if (info->version == 1 || info->kdf_blocks != 0) {
+    params->version = info->kdf_version;
+  }
+  if (info->kdf_blocks == 0 || !key_is_password(key_)) {
+    return;
+  }
+  if (info->kdf_blocks > params->nb_blocks || info->kdf_passes > params->nb_passes) {
+    Rf_error("%s: key derivation recorded in the data (memory = %u, passes = %u) is more "
+             "costly than 'kdf' allows (memory = %u, passes = %u). If the data is trusted, "
+             "use kdf = kdf_params(memory = %u, passes = %u)",
+             caller, info->kdf_blocks, info->kdf_passes, params->nb_blocks, 
+             params->nb_passes, info->kdf_blocks, info->kdf_passes);
+  }
+  params->algorithm = info->kdf_algorithm;
+  params->nb_blocks = info->kdf_blocks;
+  params->nb_passes = info->kdf_passes;
+  argon_set_lanes(params, info->kdf_lanes);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Encrypt data as a stream of chunks
+//
+// Only a single chunk of plain text/cipher text is buffered at any time, so
+// when writing to file the memory used is independent of the size of 'x'
+//
+// @param x_ raw vector
+// @param dst_ filename or NULL.  If NULL, return a raw vector
+// @param key_ 32 bytes.  Raw vector. Or hex string. Or password to feed to
+//        argon2()
+// @param additional_data_ data used for message authentication, but not
+//        encrypted or included with encrypted output
+// @param threads_ number of threads.  If greater than 1, chunks are sealed
+//        in parallel
+// @param kdf_ Argon2 parameters used if 'key_' is a password. NULL for 
+//        the defaults
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP encrypt_stream_(SEXP x_, SEXP dst_, SEXP key_, SEXP additional_data_, SEXP threads_, SEXP kdf_) {
+
+  if (TYPEOF(x_) != RAWSXP) {
+    Rf_error("encrypt_stream_(): 'x' input must be a raw vector");
+  }
+  if (!Rf_isNull(dst_) && TYPEOF(dst_) != STRSXP) {
+    Rf_error("encrypt_stream_(): 'dst' must be a filename or NULL");
+  }
+
+  uint8_t *ad = NULL;
+  size_t ad_len = 0;
+  unpack_additional_data(additional_data_, &ad, &ad_len);
+  int threads = unpack_threads(threads_);
+  argon_params params;
+  unpack_argon_params(kdf_, &params);
+
+  uint8_t *plain_text = RAW(x_);
+  size_t payload_size = (size_t)Rf_xlength(x_);
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Output is either a raw vector of the exact size, or a file
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  stream_writer w;
+  memset(&w, 0, sizeof(w));
+  SEXP res_ = R_NilValue;
+
+  if (Rf_isNull(dst_)) {
+    size_t N = stream_encrypted_size(payload_size, STREAM_CHUNKSIZE);
+    res_ = PROTECT(Rf_allocVector(RAWSXP, (R_xlen_t)N));
+    w.io.buf = RAW(res_);
+    w.io.len = N;
+  } else {
+    res_ = PROTECT(R_NilValue);
+  }
+
+  uint8_t nonce[STREAM_NONCESIZE];
+  rbyte(nonce, STREAM_NONCESIZE);
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Files are written to a temporary file in the same directory, which only
+  // replaces 'dst' once it is complete.  Devices and pipes are written
+  // directly
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const char *filename = NULL;
+  const char *tmpname  = NULL;
+  if (!Rf_isNull(dst_)) {
+    filename = R_ExpandFileName(CHAR(STRING_ELT(dst_, 0)));
+    tmpname  = temp_filename(filename);
+  }
+
+  uint8_t key[32];
+  unpack_key(key_, &params, key);
+
+  if (filename != NULL) {
+    if (stream_io_open(&w.io, tmpname != NULL ? tmpname : filename, "wb") < 0) {
+      crypto_wipe(key, sizeof(key));
+      Rf_error("encrypt_stream_(): Couldn't open file for writing '%s'", filename);
+    }
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Encrypt
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  stream_info info;
+  stream_info_init(&info, STREAM_CONTENT_RAW, 0, key_, &params);
+  int status = stream_writer_init(&w, key, nonce, ad, ad_len, STREAM_CHUNKSIZE, threads, &info);
+  crypto_wipe(key, sizeof(key));
+
+  if (status == 0) status = stream_writer_update(&w, plain_text, payload_size);
+  if (status == 0) status = stream_writer_final(&w);
+
+  const char *err = w.err;
+  if (stream_writer_free(&w) < 0 && status == 0) {
+    status = -1;
+    err = "couldn't close file";
+  }
+
+  if (tmpname != NULL) {
+    if (status < 0) {
+      remove(tmpname);
+    } else if (replace_file(tmpname, filename) < 0) {
+      status = -1;
+      err = "couldn't rename temporary file";
+    }
+  }
+
+  if (status < 0) {
+    Rf_error("encrypt_stream_(): %s", err);
+  }
+
+  UNPROTECT(1);
+  return res_;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Does this file start with a stream header? If so, unpack it into 'info'
+// and set 'err' if it is invalid
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int file_is_stream(const char *filename, stream_info *info, const char **err,
+                          const char *caller) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    Rf_error("%s: Couldn't open file for reading '%s'", caller, filename);
+  }
+  uint8_t header[STREAM_HEADERSIZE];
+  size_t n = fread(header, 1, STREAM_HEADERSIZE, fp);
+  fclose(fp);
+  *err = stream_header_info(header, n, info);
+  return stream_is_stream(header, n);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Setup a reader for a stream of chunks in a raw vector or file.
+//
+// Data in the original single-message format (as created by
+// encrypt_raw()) is passed on to decrypt_message(), and the decrypted raw
+// vector is returned.  Otherwise returns NULL, and the caller owns 'r' and 
+// 'mf' and must release them with stream_reader_free() and mapfile_close()
+//
+// Files are mapped into memory and decrypted straight from the mapping, 
+// so the encrypted data is never copied.  If the file can't be mapped, it
+// is read one chunk at a time instead.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP open_stream_src(SEXP src_, SEXP key_, SEXP additional_data_, SEXP threads_, SEXP kdf_,
+                     const char *caller, stream_reader *r, mapped_file *mf) {
+
+  uint8_t *ad = NULL;
+  size_t ad_len = 0;
+  unpack_additional_data(additional_data_, &ad, &ad_len);
+  int threads = unpack_threads(threads_);
+  argon_params params;
+  unpack_argon_params(kdf_, &params);
+
+  memset(r, 0, sizeof(*r));
+  memset(mf, 0, sizeof(*mf));
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Data which isn't a stream is decrypted as a single message
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const char *filename = NULL;
+  const char *err = NULL;
+  stream_info info;
+  if (TYPEOF(src_) == RAWSXP) {
+    if (!stream_is_stream(RAW(src_), (size_t)Rf_xlength(src_))) {
+      return decrypt_message(src_, key_, additional_data_, kdf_);
+    }
+    err = stream_header_info(RAW(src_), (size_t)Rf_xlength(src_), &info);
+  } else if (TYPEOF(src_) == STRSXP) {
+    filename = R_ExpandFileName(CHAR(STRING_ELT(src_, 0)));
+    if (!file_is_stream(filename, &info, &err, caller)) {
+      return decrypt_message_file(filename, key_, additional_data_, kdf_);
+    }
+  } else {
+    Rf_error("%s: 'src' must be a raw vector or filename", caller);
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // An invalid header can't be used to derive the key.  The data may still
+  // be a single message whose random nonce starts with the stream magic.
+  // Only if it isn't that either is the stream's error reported.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (err != NULL) {
+    SEXP dec_ = try_decrypt_message(src_, filename, key_, additional_data_, kdf_);
+    if (dec_ != NULL) {
+      return dec_;
+    }
+    Rf_error("%s: %s", caller, err);
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Setup the input source.
+  // A password is turned into a key the same way as when it was encrypted
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  use_recorded_params(&info, key_, &params, caller);
+  uint8_t key[32];
+  unpack_key(key_, &params, key);
+
+  if (filename != NULL) {
+    filename = R_ExpandFileName(CHAR(STRING_ELT(src_, 0)));
+  }
+
+  if (filename == NULL) {
+    r->io.buf = RAW(src_);
+    r->io.len = (size_t)Rf_xlength(src_);
+  } else if (mapfile_open(mf, filename) == 0) {
+    r->io.buf = (uint8_t *)mf->data;
+    r->io.len = mf->size;
+  } else if (stream_io_open(&r->io, filename, "rb") < 0) {
+    crypto_wipe(key, sizeof(key));
+    Rf_error("%s: Couldn't open file for reading '%s'", caller, filename);
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Parse the header.  As above, data which isn't a valid stream is tried
+  // as a single message before the stream's error is reported
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  int status = stream_reader_init(r, key, ad, ad_len, threads);
+  crypto_wipe(key, sizeof(key));
+
+  if (status < 0) {
+    err = r->err;
+    stream_reader_free(r);
+    mapfile_close(mf);
+    if (filename != NULL) {
+      filename = R_ExpandFileName(CHAR(STRING_ELT(src_, 0)));
+    }
+    SEXP dec_ = try_decrypt_message(src_, filename, key_, additional_data_, kdf_);
+    if (dec_ != NULL) {
+      return dec_;
+    }
+    Rf_error("%s: %s", caller, err);
+  }
+
+  return NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The reader (and any mapped file) is released by decrypt_stream_cleanup(),
+// including when allocating the result fails
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  stream_reader r;
+  mapped_file mf;
+} decrypt_stream_state;
+
+
+static SEXP decrypt_stream_body(void *data) {
+  decrypt_stream_state *s = (decrypt_stream_state *)data;
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Decrypt every frame directly into the result
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  SEXP res_ = PROTECT(Rf_allocVector(RAWSXP, (R_xlen_t)s->r.total));
+  uint8_t *plain_text = RAW(res_);
+
+  int status = stream_reader_read(&s->r, plain_text, (size_t)s->r.total);
+  if (status == 0) status = stream_reader_finish(&s->r);
+
+  if (status < 0) {
+    crypto_wipe(plain_text, (size_t)s->r.total);
+    Rf_error("decrypt_stream_(): %s", s->r.err);
+  }
+
+  UNPROTECT(1);
+  return res_;
+}
+
+
+static void decrypt_stream_cleanup(void *data) {
+  decrypt_stream_state *s = (decrypt_stream_state *)data;
+  stream_reader_free(&s->r);
+  mapfile_close(&s->mf);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decrypt a stream of chunks
+//
+// Data in the original single-message format (as created by
+// encrypt_raw()) is passed on to decrypt_message()
+//
+// @param src_ raw vector or filename
+// @param key_ 32 bytes.  Raw vector. Or hex string. Or password to feed to
+//        argon2()
+// @param additional_data_ data used for message authentication, but not
+//        encrypted or included with encrypted output
+// @param threads_ number of threads.  Chunks of streams written in parallel
+//        mode are opened in parallel
+// @param kdf_ Argon2 parameters used if 'key_' is a password. NULL for 
+//        the defaults
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP decrypt_stream_(SEXP src_, SEXP key_, SEXP additional_data_, SEXP threads_, SEXP kdf_) {
+
+  decrypt_stream_state s;
+  memset(&s, 0, sizeof(s));
+  SEXP dec_ = open_stream_src(src_, key_, additional_data_, threads_, kdf_,
+                              "decrypt_stream_()", &s.r, &s.mf);
+  if (dec_ != NULL) {
+    return dec_;
+  }
+
+  return R_ExecWithCleanup(decrypt_stream_body, &s, decrypt_stream_cleanup, &s);
+}
@@ -4,9 +4,28 @@
 
 extern SEXP encrypt_(SEXP x_  , SEXP key_, SEXP additional_data_);
 extern SEXP decrypt_(SEXP src_, SEXP key_, SEXP additional_data_);
+extern SEXP encrypt_raw_batch_(SEXP x_  , SEXP key_, SEXP additional_data_);
+extern SEXP decrypt_raw_batch_(SEXP src_, SEXP key_, SEXP additional_data_);
+extern SEXP decrypt_raw_parallel_(SEXP src_, SEXP key_, SEXP additional_data_, SEXP threads_);
 
-extern SEXP argon2_(SEXP password_, SEXP salt_, SEXP hash_length_, SEXP type_);
+extern SEXP encrypt_stream_(SEXP x_  , SEXP dst_, SEXP key_, SEXP additional_data_, SEXP threads_, SEXP kdf_);
+extern SEXP decrypt_stream_(SEXP src_, SEXP key_, SEXP additional_data_, SEXP threads_, SEXP kdf_);
+extern SEXP encrypt_serialize_(SEXP robj_, SEXP dst_, SEXP key_, SEXP additional_data_, SEXP compress_, SEXP threads_, SEXP kdf_);
+extern SEXP decrypt_unserialize_(SEXP src_, SEXP key_, SEXP additional_data_, SEXP threads_, SEXP kdf_);
+
+extern SEXP argon2_(SEXP password_, SEXP salt_, SEXP hash_length_, SEXP type_, SEXP kdf_);
+extern SEXP derive_key_(SEXP password_, SEXP salt_, SEXP kdf_);
+extern SEXP blake2b_(SEXP x_, SEXP file_, SEXP size_, SEXP key_, SEXP leaves_, SEXP threads_, SEXP type_);
 extern SEXP rcrypto_(SEXP n_, SEXP type_);
+extern SEXP simd_(SEXP enable_);
+
+extern SEXP keycache_(SEXP enable_);
+extern SEXP keycache_clear_(void);
+
+extern SEXP package_unload_(void);
+
+extern void keycache_free(void);
+extern void workarea_free(void);
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // .C      R_CMethodDef
@@ -17,8 +36,27 @@ static const R_CallMethodDef CEntries[] = {
   {"encrypt_", (DL_FUNC) &encrypt_, 3},
   {"decrypt_", (DL_FUNC) &decrypt_, 3},
   
+  {"encrypt_raw_batch_"   , (DL_FUNC) &encrypt_raw_batch_   , 3},
+  {"decrypt_raw_batch_"   , (DL_FUNC) &decrypt_raw_batch_   , 3},
+  {"decrypt_raw_parallel_", (DL_FUNC) &decrypt_raw_parallel_, 4},
+  
+  {"encrypt_stream_", (DL_FUNC) &encrypt_stream_, 6},
+  {"decrypt_stream_", (DL_FUNC) &decrypt_stream_, 5},
+  
+  {"encrypt_serialize_"  , (DL_FUNC) &encrypt_serialize_  , 7},
+  {"decrypt_unserialize_", (DL_FUNC) &decrypt_unserialize_, 5},
+  
   {"rcrypto_", (DL_FUNC) &rcrypto_, 2},
-  {"argon2_" , (DL_FUNC) &argon2_ , 4},
+  {"argon2_" , (DL_FUNC) &argon2_ , 5},
+  {"derive_key_", (DL_FUNC) &derive_key_, 3},
+  {"blake2b_"   , (DL_FUNC) &blake2b_   , 7},
+  
+  {"simd_", (DL_FUNC) &simd_, 1},
+  
+  {"keycache_"      , (DL_FUNC) &keycache_      , 1},
+  {"keycache_clear_", (DL_FUNC) &keycache_clear_, 0},
+  
+  {"package_unload_", (DL_FUNC) &package_unload_, 0},
   
   {NULL, NULL, 0}
 };
@@ -39,3 +77,27 @@ void R_init_rmonocypher(DllInfo *info) {
   );
   R_useDynamicSymbols(info, FALSE);
 }
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Wipe any cached keys and release the Argon2 work area.  Called by 
+// .onUnload()
+//
+// The DLL itself is left loaded: key handles from derive_key() have C 
+// finalizers in this DLL, and R can't unregister them.  They may run at 
+// any later garbage collection, or when R exits.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP package_unload_(void) {
+  keycache_free();
+  workarea_free();
+  return R_NilValue;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Same again if the DLL is unloaded some other way, e.g. dyn.unload()
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void R_unload_rmonocypher(DllInfo *info) {
+  keycache_free();
+  workarea_free();
+}
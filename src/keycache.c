@@ -0,0 +1,180 @@
+#define R_NO_REMAP
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include "monocypher.h"
+#include "keycache.h"
+#include "secmem.h"
+#include "rbyte.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Session cache of keys derived from passwords
+//
+// Entries are identified by a keyed BLAKE2b hash of the password, salt and
+// Argon2 parameters.  The hash key is random for each session, so the ids
+// are useless outside this process.  All of it lives in locked memory
+// (see secmem.c) and is wiped when the cache is cleared, disabled or the
+// package is unloaded.
+//
+// The cache is off unless enabled with rmonocypher_cache_enable()
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define KEYCACHE_SLOTS 32
+
+typedef struct {
+  uint8_t  id[32];
+  uint8_t  key[32];
+  uint64_t last_used;  // 0 = empty slot
+} keycache_entry;
+
+typedef struct {
+  uint8_t        secret[32];
+  uint64_t       tick;
+  keycache_entry entry[KEYCACHE_SLOTS];
+} keycache_t;
+
+static keycache_t *cache = NULL;
+
+
+int keycache_enabled(void) {
+  return cache != NULL;
+}
+
+
+static void store32_le(uint8_t *out, uint32_t x) {
+  out[0] = (uint8_t)(x      );
+  out[1] = (uint8_t)(x >>  8);
+  out[2] = (uint8_t)(x >> 16);
+  out[3] = (uint8_t)(x >> 24);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Calculate the cache id for a derived key
+//
+// @param id output
+// @param password,pass_size the password
+// @param salt,salt_size the salt.  May be NULL if the salt is itself 
+//        derived from the password
+// @param params Argon2 parameters.  The number of threads is ignored as it
+//        doesn't change the derived key
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void keycache_id(uint8_t id[32], const uint8_t *password, size_t pass_size,
+                 const uint8_t *salt, size_t salt_size, const argon_params *params) {
+  
+  // Fixed-size fields first, so the variable length password can't be
+  // confused with the other fields
+  uint8_t header[24];
+  store32_le(header +  0, params->algorithm);
+  store32_le(header +  4, params->nb_blocks);
+  store32_le(header +  8, params->nb_passes);
+  store32_le(header + 12, params->nb_lanes);
+  store32_le(header + 16, (uint32_t)salt_size);
+  store32_le(header + 20, (uint32_t)pass_size);
+  
+  crypto_blake2b_ctx ctx;
+  crypto_blake2b_keyed_init(&ctx, 32, cache->secret, 32);
+  crypto_blake2b_update(&ctx, header, sizeof(header));
+  if (salt_size > 0) {
+    crypto_blake2b_update(&ctx, salt, salt_size);
+  }
+  crypto_blake2b_update(&ctx, password, pass_size);
+  crypto_blake2b_final(&ctx, id);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Look up a key
+//
+// @return 1 if found (and copied into 'key'), otherwise 0
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int keycache_get(const uint8_t id[32], uint8_t key[32]) {
+  if (cache == NULL) return 0;
+  
+  for (int i = 0; i < KEYCACHE_SLOTS; i++) {
+    keycache_entry *e = &cache->entry[i];
+    if (e->last_used != 0 && crypto_verify32(e->id, id) == 0) {
+      e->last_used = ++cache->tick;
+      memcpy(key, e->key, 32);
+      return 1;
+    }
+  }
+  
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Add a key. When full, the least recently used key is replaced
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void keycache_put(const uint8_t id[32], const uint8_t key[32]) {
+  if (cache == NULL) return;
+  
+  keycache_entry *slot = &cache->entry[0];
+  for (int i = 0; i < KEYCACHE_SLOTS; i++) {
+    if (cache->entry[i].last_used < slot->last_used) {
+      slot = &cache->entry[i];
+    }
+  }
+  
+  memcpy(slot->id , id , 32);
+  memcpy(slot->key, key, 32);
+  slot->last_used = ++cache->tick;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Wipe all keys and release the cache.  Also called on package unload
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void keycache_free(void) {
+  secmem_free(cache, sizeof(keycache_t));
+  cache = NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Enable/disable the key cache.  Disabling wipes all cached keys.
+//
+// @param enable_ logical. Or NULL to leave the setting unchanged
+// @return logical. TRUE if the cache is enabled
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP keycache_(SEXP enable_) {
+  if (!Rf_isNull(enable_)) {
+    int enable = Rf_asLogical(enable_);
+    if (enable == NA_LOGICAL) {
+      Rf_error("keycache_(): 'enable' must be TRUE or FALSE");
+    }
+    if (!enable) {
+      keycache_free();
+    } else if (cache == NULL) {
+      uint8_t secret[32];
+      rbyte(secret, sizeof(secret));
+      keycache_t *kc = (keycache_t *)secmem_alloc(sizeof(keycache_t));
+      if (kc == NULL) {
+        crypto_wipe(secret, sizeof(secret));
+        Rf_error("keycache_(): Couldn't allocate locked memory for the key cache");
+      }
+      memcpy(kc->secret, secret, sizeof(secret));
+      crypto_wipe(secret, sizeof(secret));
+      cache = kc;
+    }
+  }
+  return Rf_ScalarLogical(keycache_enabled());
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Wipe all cached keys.  The cache stays enabled if it was enabled
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP keycache_clear_(void) {
+  if (cache != NULL) {
+    crypto_wipe(cache->entry, sizeof(cache->entry));
+    cache->tick = 0;
+  }
+  return R_NilValue;
+}
@@ -0,0 +1,11 @@
+#include <stdint.h>
+#include <stddef.h>
+
+#include "argon2.h"
+
+int  keycache_enabled(void);
+void keycache_id(uint8_t id[32], const uint8_t *password, size_t pass_size,
+                 const uint8_t *salt, size_t salt_size, const argon_params *params);
+int  keycache_get(const uint8_t id[32], uint8_t key[32]);
+void keycache_put(const uint8_t id[32], const uint8_t key[32]);
+void keycache_free(void);
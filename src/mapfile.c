@@ -0,0 +1,108 @@
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "mapfile.h"
+
+// Not using the R API in this file.  Callers decide how to report failure.
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Map a whole file read-only into memory
+//
+// Pages are read in by the OS as they are touched, so large files can be
+// processed without copying them into an R vector first.  An empty file
+// gives data = NULL and size = 0.
+//
+// @param mf mapping to fill in. Release with mapfile_close()
+// @param filename file to map
+// @return 0 on success, -1 if the file couldn't be opened or mapped
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int mapfile_open(mapped_file *mf, const char *filename) {
+  memset(mf, 0, sizeof(*mf));
+
+#if defined(_WIN32)
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file == INVALID_HANDLE_VALUE) return -1;
+  
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size)) {
+    CloseHandle(file);
+    return -1;
+  }
+  if (size.QuadPart == 0) {
+    CloseHandle(file);
+    return 0;
+  }
+  
+  HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping == NULL) {
+    CloseHandle(file);
+    return -1;
+  }
+  void *p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (p == NULL) {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return -1;
+  }
+  
+  mf->file    = file;
+  mf->mapping = mapping;
+  mf->data    = (const uint8_t *)p;
+  mf->size    = (size_t)size.QuadPart;
+#else
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return -1;
+  
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  
+  void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); // the mapping keeps its own reference to the file
+  if (p == MAP_FAILED) return -1;
+  
+#if defined(MADV_SEQUENTIAL)
+  madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+  
+  mf->data = (const uint8_t *)p;
+  mf->size = (size_t)st.st_size;
+#endif
+
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Unmap a file mapped with mapfile_open()
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void mapfile_close(mapped_file *mf) {
+#if defined(_WIN32)
+  if (mf->data    != NULL) UnmapViewOfFile((LPCVOID)mf->data);
+  if (mf->mapping != NULL) CloseHandle(mf->mapping);
+  if (mf->file    != NULL) CloseHandle(mf->file);
+#else
+  if (mf->data != NULL) munmap((void *)mf->data, mf->size);
+#endif
+  memset(mf, 0, sizeof(*mf));
+}
@@ -0,0 +1,14 @@
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+#if defined(_WIN32)
+  void *file;
+  void *mapping;
+#endif
+} mapped_file;
+
+int  mapfile_open(mapped_file *mf, const char *filename);
+void mapfile_close(mapped_file *mf);
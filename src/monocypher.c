@@ -51,7 +51,20 @@
 // with this software.  If not, see
 // <https://creativecommons.org/publicdomain/zero/1.0/>
 
+#include <string.h>
+
 #include "monocypher.h"
+#include "parallel.h"
+
+// rmonocypher: vectorised code paths are built on x86-64 with GCC or clang,
+// and selected at runtime when the CPU supports them.  Define
+// MONOCYPHER_NO_SIMD to build only the portable code.
+#if !defined(MONOCYPHER_NO_SIMD) && defined(__x86_64__) && \
+	(defined(__GNUC__) || defined(__clang__))
+#define MONOCYPHER_AVX2 1
+#include <immintrin.h>
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
 
 #ifdef MONOCYPHER_CPP_NAMESPACE
 namespace MONOCYPHER_CPP_NAMESPACE {
@@ -160,10 +173,32 @@ int crypto_verify16(const u8 a[16], const u8 b[16]){ return neq0(x16(a, b)); }
 int crypto_verify32(const u8 a[32], const u8 b[32]){ return neq0(x32(a, b)); }
 int crypto_verify64(const u8 a[64], const u8 b[64]){ return neq0(x64(a, b)); }
 
+// rmonocypher: a plain memset() followed by a compiler barrier that
+// claims to read the buffer, so the stores can't be elided.  Much faster
+// than a volatile loop on large buffers (the Argon2 work area).
 void crypto_wipe(void *secret, size_t size)
 {
+#if defined(__GNUC__) || defined(__clang__)
+	memset(secret, 0, size);
+	__asm__ __volatile__("" : : "r"(secret) : "memory");
+#else
 	volatile u8 *v_secret = (u8*)secret;
 	ZERO(v_secret, size);
+#endif
+}
+
+////////////////////////
+/// Runtime dispatch ///
+////////////////////////
+int crypto_simd_enabled = 1;
+
+int crypto_simd_avx2(void)
+{
+#ifdef MONOCYPHER_AVX2
+	return crypto_simd_enabled && __builtin_cpu_supports("avx2");
+#else
+	return 0;
+#endif
 }
 
 /////////////////
@@ -199,6 +234,130 @@ static void chacha20_rounds(u32 out[16], const u32 in[16])
 	out[12] = t12;  out[13] = t13;  out[14] = t14;  out[15] = t15;
 }
 
+#ifdef MONOCYPHER_AVX2
+#define ROTL_AVX2(x, n)	\
+	_mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n))
+#define QUARTERROUND_AVX2(a, b, c, d)	\
+	a = _mm256_add_epi32(a, b);  d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16); \
+	c = _mm256_add_epi32(c, d);  b = ROTL_AVX2(_mm256_xor_si256(b, c), 12);            \
+	a = _mm256_add_epi32(a, b);  d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8);  \
+	c = _mm256_add_epi32(c, d);  b = ROTL_AVX2(_mm256_xor_si256(b, c),  7)
+
+// Transpose 8 vectors of 8 words, so that each block gets one word from
+// every vector, then XOR with the input (if any) and store 32 bytes per
+// block.  Block i starts at dst + i*64.
+AVX2_TARGET
+static inline void chacha20_store_avx2(u8 *dst, const u8 *src,
+                                       __m256i x0, __m256i x1, __m256i x2, __m256i x3,
+                                       __m256i x4, __m256i x5, __m256i x6, __m256i x7)
+{
+	__m256i t0 = _mm256_unpacklo_epi32(x0, x1);
+	__m256i t1 = _mm256_unpackhi_epi32(x0, x1);
+	__m256i t2 = _mm256_unpacklo_epi32(x2, x3);
+	__m256i t3 = _mm256_unpackhi_epi32(x2, x3);
+	__m256i t4 = _mm256_unpacklo_epi32(x4, x5);
+	__m256i t5 = _mm256_unpackhi_epi32(x4, x5);
+	__m256i t6 = _mm256_unpacklo_epi32(x6, x7);
+	__m256i t7 = _mm256_unpackhi_epi32(x6, x7);
+	__m256i u[8];
+	u[0] = _mm256_unpacklo_epi64(t0, t2);  // blocks 0, 4
+	u[1] = _mm256_unpackhi_epi64(t0, t2);  // blocks 1, 5
+	u[2] = _mm256_unpacklo_epi64(t1, t3);  // blocks 2, 6
+	u[3] = _mm256_unpackhi_epi64(t1, t3);  // blocks 3, 7
+	u[4] = _mm256_unpacklo_epi64(t4, t6);
+	u[5] = _mm256_unpackhi_epi64(t4, t6);
+	u[6] = _mm256_unpacklo_epi64(t5, t7);
+	u[7] = _mm256_unpackhi_epi64(t5, t7);
+	for (int i = 0; i < 4; i++) {
+		__m256i lo = _mm256_permute2x128_si256(u[i], u[i+4], 0x20);
+		__m256i hi = _mm256_permute2x128_si256(u[i], u[i+4], 0x31);
+		if (src != 0) {
+			lo = _mm256_xor_si256(lo, _mm256_loadu_si256((const __m256i*)(src + i*64)));
+			hi = _mm256_xor_si256(hi, _mm256_loadu_si256((const __m256i*)(src + i*64 + 256)));
+		}
+		_mm256_storeu_si256((__m256i*)(dst + i*64      ), lo);
+		_mm256_storeu_si256((__m256i*)(dst + i*64 + 256), hi);
+	}
+}
+
+// Encrypt 'nb_blocks' blocks (a multiple of 8), 8 blocks at a time.
+// Each 32-bit lane of the vectors holds one of the 8 blocks.
+// The counter in input[12..13] is advanced past the processed blocks.
+AVX2_TARGET
+static void chacha20_blocks_avx2(u8 *cipher_text, const u8 *plain_text,
+                                 size_t nb_blocks, u32 input[16])
+{
+	const __m256i rot16 = _mm256_setr_epi8(
+		2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+		2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+	const __m256i rot8 = _mm256_setr_epi8(
+		3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+		3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+
+	u64 ctr = input[12] + ((u64)input[13] << 32);
+	for (size_t b = 0; b < nb_blocks; b += 8) {
+		u32 lo[8], hi[8];
+		FOR (j, 0, 8) {
+			lo[j] = (u32) (ctr + j);
+			hi[j] = (u32)((ctr + j) >> 32);
+		}
+		__m256i c12 = _mm256_loadu_si256((const __m256i*)lo);
+		__m256i c13 = _mm256_loadu_si256((const __m256i*)hi);
+
+		// The temporary variables keep the state in registers
+		__m256i t0  = _mm256_set1_epi32((int)input[ 0]);
+		__m256i t1  = _mm256_set1_epi32((int)input[ 1]);
+		__m256i t2  = _mm256_set1_epi32((int)input[ 2]);
+		__m256i t3  = _mm256_set1_epi32((int)input[ 3]);
+		__m256i t4  = _mm256_set1_epi32((int)input[ 4]);
+		__m256i t5  = _mm256_set1_epi32((int)input[ 5]);
+		__m256i t6  = _mm256_set1_epi32((int)input[ 6]);
+		__m256i t7  = _mm256_set1_epi32((int)input[ 7]);
+		__m256i t8  = _mm256_set1_epi32((int)input[ 8]);
+		__m256i t9  = _mm256_set1_epi32((int)input[ 9]);
+		__m256i t10 = _mm256_set1_epi32((int)input[10]);
+		__m256i t11 = _mm256_set1_epi32((int)input[11]);
+		__m256i t12 = c12;
+		__m256i t13 = c13;
+		__m256i t14 = _mm256_set1_epi32((int)input[14]);
+		__m256i t15 = _mm256_set1_epi32((int)input[15]);
+
+		FOR (i, 0, 10) { // 20 rounds, 2 rounds per loop.
+			QUARTERROUND_AVX2(t0, t4, t8 , t12); // column 0
+			QUARTERROUND_AVX2(t1, t5, t9 , t13); // column 1
+			QUARTERROUND_AVX2(t2, t6, t10, t14); // column 2
+			QUARTERROUND_AVX2(t3, t7, t11, t15); // column 3
+			QUARTERROUND_AVX2(t0, t5, t10, t15); // diagonal 0
+			QUARTERROUND_AVX2(t1, t6, t11, t12); // diagonal 1
+			QUARTERROUND_AVX2(t2, t7, t8 , t13); // diagonal 2
+			QUARTERROUND_AVX2(t3, t4, t9 , t14); // diagonal 3
+		}
+#define ADD_INPUT(t, i) t = _mm256_add_epi32(t, _mm256_set1_epi32((int)input[i]))
+		ADD_INPUT(t0, 0);  ADD_INPUT(t1,  1);  ADD_INPUT(t2,  2);  ADD_INPUT(t3,  3);
+		ADD_INPUT(t4, 4);  ADD_INPUT(t5,  5);  ADD_INPUT(t6,  6);  ADD_INPUT(t7,  7);
+		ADD_INPUT(t8, 8);  ADD_INPUT(t9,  9);  ADD_INPUT(t10, 10); ADD_INPUT(t11, 11);
+		ADD_INPUT(t14, 14); ADD_INPUT(t15, 15);
+#undef ADD_INPUT
+		t12 = _mm256_add_epi32(t12, c12);
+		t13 = _mm256_add_epi32(t13, c13);
+
+		// words 0..7, then words 8..15 of each block
+		chacha20_store_avx2(cipher_text, plain_text,
+		                    t0, t1, t2, t3, t4, t5, t6, t7);
+		chacha20_store_avx2(cipher_text + 32, plain_text == 0 ? 0 : plain_text + 32,
+		                    t8, t9, t10, t11, t12, t13, t14, t15);
+
+		cipher_text += 512;
+		if (plain_text != 0) {
+			plain_text += 512;
+		}
+		ctr += 8;
+	}
+	input[12] = (u32) ctr;
+	input[13] = (u32)(ctr >> 32);
+}
+#endif // MONOCYPHER_AVX2
+
 static const u8 *chacha20_constant = (const u8*)"expand 32-byte k"; // 16 bytes
 
 void crypto_chacha20_h(u8 out[32], const u8 key[32], const u8 in [16])
@@ -230,6 +389,17 @@ u64 crypto_chacha20_djb(u8 *cipher_text, const u8 *plain_text,
 	// Whole blocks
 	u32    pool[16];
 	size_t nb_blocks = text_size >> 6;
+#ifdef MONOCYPHER_AVX2
+	if (nb_blocks >= 8 && crypto_simd_avx2()) {
+		size_t nb_wide = nb_blocks & ~(size_t)7;
+		chacha20_blocks_avx2(cipher_text, plain_text, nb_wide, input);
+		cipher_text += nb_wide * 64;
+		if (plain_text != 0) {
+			plain_text += nb_wide * 64;
+		}
+		nb_blocks -= nb_wide;
+	}
+#endif
 	FOR (i, 0, nb_blocks) {
 		chacha20_rounds(pool, input);
 		if (plain_text != 0) {
@@ -307,8 +477,8 @@ u64 crypto_chacha20_x(u8 *cipher_text, const u8 *plain_text,
 //   end    <= 1
 // Postcondition:
 //   ctx->h <= 4_ffffffff_ffffffff_ffffffff_ffffffff
-static void poly_blocks(crypto_poly1305_ctx *ctx, const u8 *in,
-                        size_t nb_blocks, unsigned end)
+static void poly_blocks_32(crypto_poly1305_ctx *ctx, const u8 *in,
+                           size_t nb_blocks, unsigned end)
 {
 	// Local all the things!
 	const u32 r0 = ctx->r[0];
@@ -363,6 +533,240 @@ static void poly_blocks(crypto_poly1305_ctx *ctx, const u8 *in,
 	ctx->h[4] = h4;
 }
 
+#if defined(__SIZEOF_INT128__) && !defined(MONOCYPHER_NO_INT128)
+// rmonocypher: on 64-bit targets the hash is kept in 3 limbs of 44, 44 and
+// 42 bits, so each block takes 9 64x64->128 bit products instead of
+// 17 32x32->64 bit ones.  Same pre/post conditions as poly_blocks_32().
+#define POLY1305_64 1
+__extension__ typedef unsigned __int128 u128;
+
+static void poly_blocks_64(crypto_poly1305_ctx *ctx, const u8 *in,
+                           size_t nb_blocks, unsigned end)
+{
+	const u64 mask44 = 0xfffffffffff;
+	const u64 mask42 = 0x3ffffffffff;
+
+	// r is already clamped
+	const u64 t0 = ctx->r[0] | ((u64)ctx->r[1] << 32);
+	const u64 t1 = ctx->r[2] | ((u64)ctx->r[3] << 32);
+	const u64 r0 =   t0                     & mask44;
+	const u64 r1 = ((t0 >> 44) | (t1 << 20)) & mask44;
+	const u64 r2 =   t1 >> 24;
+	const u64 s1 = r1 * (5 << 2);
+	const u64 s2 = r2 * (5 << 2);
+
+	const u64 g0 = ctx->h[0] | ((u64)ctx->h[1] << 32);
+	const u64 g1 = ctx->h[2] | ((u64)ctx->h[3] << 32);
+	u64 h0 =   g0                     & mask44;
+	u64 h1 = ((g0 >> 44) | (g1 << 20)) & mask44;
+	u64 h2 =  (g1 >> 24) | ((u64)ctx->h[4] << 40);
+	const u64 hibit = (u64)end << 40;
+
+	FOR (i, 0, nb_blocks) {
+		// h + c, without carry propagation
+		const u64 c0 = load64_le(in);
+		const u64 c1 = load64_le(in + 8);
+		in += 16;
+		h0 +=   c0                     & mask44;
+		h1 += ((c0 >> 44) | (c1 << 20)) & mask44;
+		h2 +=  (c1 >> 24) | hibit;
+
+		// (h + c) * r, without carry propagation
+		const u128 d0 = (u128)h0*r0 + (u128)h1*s2 + (u128)h2*s1;
+		u128       d1 = (u128)h0*r1 + (u128)h1*r0 + (u128)h2*s2;
+		u128       d2 = (u128)h0*r2 + (u128)h1*r1 + (u128)h2*r0;
+
+		// partial reduction modulo 2^130 - 5
+		h0 = (u64)d0 & mask44;  d1 += (u64)(d0 >> 44);
+		h1 = (u64)d1 & mask44;  d2 += (u64)(d1 >> 44);
+		h2 = (u64)d2 & mask42;
+		h0 += (u64)(d2 >> 42) * 5;
+		h1 += h0 >> 44;
+		h0 &= mask44;
+	}
+
+	// Back to 32-bit limbs (h may exceed 2^128)
+	const u128 lo = h0 + ((u128)h1 << 44);
+	const u128 hi = (lo >> 64) + ((u128)h2 << 24);
+	ctx->h[0] = (u32)(lo      );
+	ctx->h[1] = (u32)(lo >> 32);
+	ctx->h[2] = (u32)(hi      );
+	ctx->h[3] = (u32)(hi >> 32);
+	ctx->h[4] = (u32)(hi >> 64);
+}
+#endif
+
+static void poly_blocks(crypto_poly1305_ctx *ctx, const u8 *in,
+                        size_t nb_blocks, unsigned end)
+{
+#ifdef POLY1305_64
+	if (crypto_simd_enabled) {
+		poly_blocks_64(ctx, in, nb_blocks, end);
+		return;
+	}
+#endif
+	poly_blocks_32(ctx, in, nb_blocks, end);
+}
+
+#ifdef MONOCYPHER_AVX2
+// Radix 2^26 arithmetic for the vectorised code: 5 limbs of 26 bits.
+// Limbs are held in 64-bit words so products can be summed without carry.
+static void poly26_from32(u64 out[5], const u32 in[5])
+{
+	out[0] =  (u64)in[0]                        & 0x3ffffff;
+	out[1] = ((u64)in[0] >> 26 | (u64)in[1] <<  6) & 0x3ffffff;
+	out[2] = ((u64)in[1] >> 20 | (u64)in[2] << 12) & 0x3ffffff;
+	out[3] = ((u64)in[2] >> 14 | (u64)in[3] << 18) & 0x3ffffff;
+	out[4] =  (u64)in[3] >>  8 | (u64)in[4] << 24;
+}
+
+// Inverse of poly26_from32().  'in' must be carried.
+static void poly26_to32(u32 out[5], const u64 in[5])
+{
+	u64 c = in[0] + (in[1] << 26);  out[0] = (u32)c;  c >>= 32;
+	c += in[2] << 20;               out[1] = (u32)c;  c >>= 32;
+	c += in[3] << 14;               out[2] = (u32)c;  c >>= 32;
+	c += in[4] <<  8;               out[3] = (u32)c;  c >>= 32;
+	out[4] = (u32)c;
+}
+
+// acc += a * b (mod 2^130 - 5), without carry propagation
+static void poly26_mul_add(u64 acc[5], const u64 a[5], const u64 b[5])
+{
+	const u64 s1 = b[1] * 5, s2 = b[2] * 5, s3 = b[3] * 5, s4 = b[4] * 5;
+	acc[0] += a[0]*b[0] + a[1]*s4   + a[2]*s3   + a[3]*s2   + a[4]*s1;
+	acc[1] += a[0]*b[1] + a[1]*b[0] + a[2]*s4   + a[3]*s3   + a[4]*s2;
+	acc[2] += a[0]*b[2] + a[1]*b[1] + a[2]*b[0] + a[3]*s4   + a[4]*s3;
+	acc[3] += a[0]*b[3] + a[1]*b[2] + a[2]*b[1] + a[3]*b[0] + a[4]*s4;
+	acc[4] += a[0]*b[4] + a[1]*b[3] + a[2]*b[2] + a[3]*b[1] + a[4]*b[0];
+}
+
+// Partial reduction: every limb ends up below 2^26, except limb 1 which
+// may be slightly larger.
+static void poly26_carry(u64 h[5])
+{
+	h[1] += h[0] >> 26;      h[0] &= 0x3ffffff;
+	h[2] += h[1] >> 26;      h[1] &= 0x3ffffff;
+	h[3] += h[2] >> 26;      h[2] &= 0x3ffffff;
+	h[4] += h[3] >> 26;      h[3] &= 0x3ffffff;
+	h[0] += (h[4] >> 26)*5;  h[4] &= 0x3ffffff;
+	h[1] += h[0] >> 26;      h[0] &= 0x3ffffff;
+}
+
+#define MUL_AVX2(a, b) _mm256_mul_epu32(a, b)
+#define ADD_AVX2(a, b) _mm256_add_epi64(a, b)
+
+// Absorb 'nb_blocks' full blocks (a multiple of 4), 4 blocks per step.
+// Lane j of the accumulator holds blocks j, j+4, j+8...  Each step
+// multiplies the accumulator by r^4, and the lanes are combined at the end
+// with r^4, r^3, r^2 and r respectively (parallel Horner evaluation).
+AVX2_TARGET
+static void poly_blocks_avx2(crypto_poly1305_ctx *ctx, const u8 *in,
+                             size_t nb_blocks)
+{
+	// powers of r
+	u32 r32[5] = {ctx->r[0], ctx->r[1], ctx->r[2], ctx->r[3], 0};
+	u64 r[4][5];
+	poly26_from32(r[0], r32);
+	FOR (i, 1, 4) {
+		ZERO(r[i], 5);
+		poly26_mul_add(r[i], r[i-1], r[0]);
+		poly26_carry(r[i]);
+	}
+
+	const __m256i mask = _mm256_set1_epi64x(0x3ffffff);
+	const __m256i hibit = _mm256_set1_epi64x(1 << 24);
+	__m256i r4[5], s4[5];
+	FOR (i, 0, 5) {
+		r4[i] = _mm256_set1_epi64x((long long)r[3][i]);
+		s4[i] = _mm256_set1_epi64x((long long)r[3][i] * 5);
+	}
+
+	// Existing hash goes in lane 0
+	u64 h[5];
+	poly26_from32(h, ctx->h);
+	__m256i h0 = _mm256_setr_epi64x((long long)h[0], 0, 0, 0);
+	__m256i h1 = _mm256_setr_epi64x((long long)h[1], 0, 0, 0);
+	__m256i h2 = _mm256_setr_epi64x((long long)h[2], 0, 0, 0);
+	__m256i h3 = _mm256_setr_epi64x((long long)h[3], 0, 0, 0);
+	__m256i h4 = _mm256_setr_epi64x((long long)h[4], 0, 0, 0);
+
+	for (size_t b = 0; b < nb_blocks; b += 4) {
+		// Load 4 blocks, and split into 26-bit limbs. Lane j is block j.
+		__m256i a  = _mm256_loadu_si256((const __m256i*)(in     ));
+		__m256i c  = _mm256_loadu_si256((const __m256i*)(in + 32));
+		__m256i lo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, c), 0xd8);
+		__m256i hi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(a, c), 0xd8);
+		in += 64;
+
+		h0 = ADD_AVX2(h0, _mm256_and_si256(lo, mask));
+		h1 = ADD_AVX2(h1, _mm256_and_si256(_mm256_srli_epi64(lo, 26), mask));
+		h2 = ADD_AVX2(h2, _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi64(lo, 52),
+		                                                   _mm256_slli_epi64(hi, 12)), mask));
+		h3 = ADD_AVX2(h3, _mm256_and_si256(_mm256_srli_epi64(hi, 14), mask));
+		h4 = ADD_AVX2(h4, _mm256_or_si256(_mm256_srli_epi64(hi, 40), hibit));
+
+		// The last 4 blocks are multiplied by r^4..r^1 below instead
+		if (b + 4 == nb_blocks) {
+			break;
+		}
+
+		// (h + m) * r^4
+		__m256i d0 = ADD_AVX2(ADD_AVX2(ADD_AVX2(ADD_AVX2(
+			MUL_AVX2(h0, r4[0]), MUL_AVX2(h1, s4[4])), MUL_AVX2(h2, s4[3])),
+			MUL_AVX2(h3, s4[2])), MUL_AVX2(h4, s4[1]));
+		__m256i d1 = ADD_AVX2(ADD_AVX2(ADD_AVX2(ADD_AVX2(
+			MUL_AVX2(h0, r4[1]), MUL_AVX2(h1, r4[0])), MUL_AVX2(h2, s4[4])),
+			MUL_AVX2(h3, s4[3])), MUL_AVX2(h4, s4[2]));
+		__m256i d2 = ADD_AVX2(ADD_AVX2(ADD_AVX2(ADD_AVX2(
+			MUL_AVX2(h0, r4[2]), MUL_AVX2(h1, r4[1])), MUL_AVX2(h2, r4[0])),
+			MUL_AVX2(h3, s4[4])), MUL_AVX2(h4, s4[3]));
+		__m256i d3 = ADD_AVX2(ADD_AVX2(ADD_AVX2(ADD_AVX2(
+			MUL_AVX2(h0, r4[3]), MUL_AVX2(h1, r4[2])), MUL_AVX2(h2, r4[1])),
+			MUL_AVX2(h3, r4[0])), MUL_AVX2(h4, s4[4]));
+		__m256i d4 = ADD_AVX2(ADD_AVX2(ADD_AVX2(ADD_AVX2(
+			MUL_AVX2(h0, r4[4]), MUL_AVX2(h1, r4[3])), MUL_AVX2(h2, r4[2])),
+			MUL_AVX2(h3, r4[1])), MUL_AVX2(h4, r4[0]));
+
+		// partial reduction modulo 2^130 - 5
+		__m256i t;
+		d1 = ADD_AVX2(d1, _mm256_srli_epi64(d0, 26));  h0 = _mm256_and_si256(d0, mask);
+		d2 = ADD_AVX2(d2, _mm256_srli_epi64(d1, 26));  h1 = _mm256_and_si256(d1, mask);
+		d3 = ADD_AVX2(d3, _mm256_srli_epi64(d2, 26));  h2 = _mm256_and_si256(d2, mask);
+		d4 = ADD_AVX2(d4, _mm256_srli_epi64(d3, 26));  h3 = _mm256_and_si256(d3, mask);
+		t  = _mm256_srli_epi64(d4, 26);                h4 = _mm256_and_si256(d4, mask);
+		h0 = ADD_AVX2(h0, ADD_AVX2(t, _mm256_slli_epi64(t, 2)));
+		h1 = ADD_AVX2(h1, _mm256_srli_epi64(h0, 26));  h0 = _mm256_and_si256(h0, mask);
+	}
+
+	// Combine the lanes: h = h_0 r^4 + h_1 r^3 + h_2 r^2 + h_3 r
+	u64 lanes[5][4];
+	_mm256_storeu_si256((__m256i*)lanes[0], h0);
+	_mm256_storeu_si256((__m256i*)lanes[1], h1);
+	_mm256_storeu_si256((__m256i*)lanes[2], h2);
+	_mm256_storeu_si256((__m256i*)lanes[3], h3);
+	_mm256_storeu_si256((__m256i*)lanes[4], h4);
+	ZERO(h, 5);
+	FOR (j, 0, 4) {
+		u64 lane[5];
+		FOR (i, 0, 5) {
+			lane[i] = lanes[i][j];
+		}
+		poly26_mul_add(h, lane, r[3 - j]);
+	}
+	poly26_carry(h);
+	poly26_to32(ctx->h, h);
+
+	WIPE_BUFFER(r);
+	WIPE_BUFFER(r4);
+	WIPE_BUFFER(s4);
+	WIPE_BUFFER(h);
+	WIPE_BUFFER(lanes);
+}
+#undef MUL_AVX2
+#undef ADD_AVX2
+#endif // MONOCYPHER_AVX2
+
 void crypto_poly1305_init(crypto_poly1305_ctx *ctx, const u8 key[32])
 {
 	ZERO(ctx->h, 5); // Initial hash is zero
@@ -399,6 +803,14 @@ void crypto_poly1305_update(crypto_poly1305_ctx *ctx,
 
 	// Process the message block by block
 	size_t nb_blocks = message_size >> 4;
+#ifdef MONOCYPHER_AVX2
+	if (nb_blocks >= 16 && crypto_simd_avx2()) {
+		size_t nb_wide = nb_blocks & ~(size_t)3;
+		poly_blocks_avx2(ctx, message, nb_wide);
+		message   += nb_wide << 4;
+		nb_blocks -= nb_wide;
+	}
+#endif
 	poly_blocks(ctx, message, nb_blocks, 1);
 	message      += nb_blocks << 4;
 	message_size &= 15;
@@ -458,7 +870,84 @@ static const u64 iv[8] = {
 	0x1f83d9abfb41bd6b, 0x5be0cd19137e2179,
 };
 
-static void blake2b_compress(crypto_blake2b_ctx *ctx, int is_last_block)
+#ifdef MONOCYPHER_AVX2
+// Helpers for the vectorised BLAKE2b and Argon2.  Each register holds 4
+// 64-bit words.  ROTR24 and ROTR16 need ROTR_AVX2_MASKS in scope.
+#define ROTR_AVX2_MASKS	\
+	const __m256i r24 = _mm256_setr_epi8(                              \
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15,  8,  9, 10,    \
+		3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15,  8,  9, 10);   \
+	const __m256i r16 = _mm256_setr_epi8(                              \
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15,  8,  9,    \
+		2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15,  8,  9)
+#define ROTR32_AVX2(x) _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+#define ROTR24_AVX2(x) _mm256_shuffle_epi8(x, r24)
+#define ROTR16_AVX2(x) _mm256_shuffle_epi8(x, r16)
+#define ROTR63_AVX2(x) \
+	_mm256_xor_si256(_mm256_srli_epi64(x, 63), _mm256_add_epi64(x, x))
+
+// Rotate rows 1, 2 and 3 by 1, 2 and 3 words, so the diagonals of the
+// 4x4 state line up as columns.  And back.
+#define DIAGONALIZE_AVX2(b, c, d)	\
+	b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(0, 3, 2, 1)); \
+	c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2)); \
+	d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(2, 1, 0, 3))
+#define UNDIAGONALIZE_AVX2(b, c, d)	\
+	b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(2, 1, 0, 3)); \
+	c = _mm256_permute4x64_epi64(c, _MM_SHUFFLE(1, 0, 3, 2)); \
+	d = _mm256_permute4x64_epi64(d, _MM_SHUFFLE(0, 3, 2, 1))
+
+#define BLAKE2_G_AVX2(a, b, c, d, x, y)	\
+	a = _mm256_add_epi64(_mm256_add_epi64(a, b), x);             \
+	d = ROTR32_AVX2(_mm256_xor_si256(d, a));                     \
+	c = _mm256_add_epi64(c, d);                                  \
+	b = ROTR24_AVX2(_mm256_xor_si256(b, c));                     \
+	a = _mm256_add_epi64(_mm256_add_epi64(a, b), y);             \
+	d = ROTR16_AVX2(_mm256_xor_si256(d, a));                     \
+	c = _mm256_add_epi64(c, d);                                  \
+	b = ROTR63_AVX2(_mm256_xor_si256(b, c))
+#define BLAKE2_MSG_AVX2(s, i)	\
+	_mm256_set_epi64x((long long)input[s[i + 6]], (long long)input[s[i + 4]], \
+	                  (long long)input[s[i + 2]], (long long)input[s[i    ]])
+
+// Same as the portable code below: the 4 G functions on the columns run
+// in parallel, then the 4 on the diagonals.
+AVX2_TARGET
+static void blake2b_compress_avx2(crypto_blake2b_ctx *ctx, int is_last_block,
+                                  int is_last_node, const u8 sigma[12][16])
+{
+	ROTR_AVX2_MASKS;
+	const u64 *input = ctx->input;
+	__m256i h0 = _mm256_loadu_si256((const __m256i*)(ctx->hash    ));
+	__m256i h1 = _mm256_loadu_si256((const __m256i*)(ctx->hash + 4));
+	__m256i a  = h0;
+	__m256i b  = h1;
+	__m256i c  = _mm256_loadu_si256((const __m256i*)(iv    ));
+	__m256i d  = _mm256_xor_si256(
+		_mm256_loadu_si256((const __m256i*)(iv + 4)),
+		_mm256_set_epi64x((long long)~(u64)(is_last_node  - 1),
+		                  (long long)~(u64)(is_last_block - 1),
+		                  (long long)ctx->input_offset[1],
+		                  (long long)ctx->input_offset[0]));
+
+	FOR (i, 0, 12) {
+		const u8 *s = sigma[i];
+		BLAKE2_G_AVX2(a, b, c, d, BLAKE2_MSG_AVX2(s, 0), BLAKE2_MSG_AVX2(s, 1));
+		DIAGONALIZE_AVX2(b, c, d);
+		BLAKE2_G_AVX2(a, b, c, d, BLAKE2_MSG_AVX2(s, 8), BLAKE2_MSG_AVX2(s, 9));
+		UNDIAGONALIZE_AVX2(b, c, d);
+	}
+
+	h0 = _mm256_xor_si256(h0, _mm256_xor_si256(a, c));
+	h1 = _mm256_xor_si256(h1, _mm256_xor_si256(b, d));
+	_mm256_storeu_si256((__m256i*)(ctx->hash    ), h0);
+	_mm256_storeu_si256((__m256i*)(ctx->hash + 4), h1);
+}
+#endif // MONOCYPHER_AVX2
+
+// rmonocypher: 'is_last_node' sets the last node flag used in tree hashing.
+static void blake2b_compress(crypto_blake2b_ctx *ctx, int is_last_block,
+                             int is_last_node)
 {
 	static const u8 sigma[12][16] = {
 		{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
@@ -483,6 +972,13 @@ static void blake2b_compress(crypto_blake2b_ctx *ctx, int is_last_block)
 		x[1]++;
 	}
 
+#ifdef MONOCYPHER_AVX2
+	if (crypto_simd_avx2()) {
+		blake2b_compress_avx2(ctx, is_last_block, is_last_node, sigma);
+		return;
+	}
+#endif
+
 	// init work vector
 	u64 v0 = ctx->hash[0];  u64 v8  = iv[0];
 	u64 v1 = ctx->hash[1];  u64 v9  = iv[1];
@@ -491,7 +987,7 @@ static void blake2b_compress(crypto_blake2b_ctx *ctx, int is_last_block)
 	u64 v4 = ctx->hash[4];  u64 v12 = iv[4] ^ ctx->input_offset[0];
 	u64 v5 = ctx->hash[5];  u64 v13 = iv[5] ^ ctx->input_offset[1];
 	u64 v6 = ctx->hash[6];  u64 v14 = iv[6] ^ (u64)~(is_last_block - 1);
-	u64 v7 = ctx->hash[7];  u64 v15 = iv[7];
+	u64 v7 = ctx->hash[7];  u64 v15 = iv[7] ^ (u64)~(is_last_node  - 1);
 
 	// mangle work vector
 	u64 *input = ctx->input;
@@ -589,7 +1085,7 @@ void crypto_blake2b_update(crypto_blake2b_ctx *ctx,
 	size_t nb_blocks = message_size >> 7;
 	FOR (i, 0, nb_blocks) {
 		if (ctx->input_idx == 128) {
-			blake2b_compress(ctx, 0);
+			blake2b_compress(ctx, 0, 0);
 		}
 		load64_le_buf(ctx->input, message, 16);
 		message += 128;
@@ -600,7 +1096,7 @@ void crypto_blake2b_update(crypto_blake2b_ctx *ctx,
 	if (message_size != 0) {
 		// Compress block & flush input buffer as needed
 		if (ctx->input_idx == 128) {
-			blake2b_compress(ctx, 0);
+			blake2b_compress(ctx, 0, 0);
 			ctx->input_idx = 0;
 		}
 		if (ctx->input_idx == 0) {
@@ -623,9 +1119,27 @@ void crypto_blake2b_update(crypto_blake2b_ctx *ctx,
 	}
 }
 
-void crypto_blake2b_final(crypto_blake2b_ctx *ctx, u8 *hash)
+// rmonocypher: tree hashing.  The parameter block (BLAKE2 spec, 2.5) is
+// XORed with the IV, so the sequential parameters set by
+// crypto_blake2b_keyed_init() are swapped for the tree parameters.
+void crypto_blake2b_node_init(crypto_blake2b_ctx *ctx, size_t hash_size,
+                              const u8 *key, size_t key_size,
+                              const crypto_blake2b_node *node)
 {
-	blake2b_compress(ctx, 1); // compress the last block
+	crypto_blake2b_keyed_init(ctx, hash_size, key, key_size);
+	ctx->hash[0] ^= 0x01010000 ^ (key_size << 8) ^ hash_size;
+	ctx->hash[0] ^= (u64)node->digest_size
+		^ ((u64)node->key_size  <<  8)
+		^ ((u64)node->fanout    << 16)
+		^ ((u64)node->depth     << 24)
+		^ ((u64)node->leaf_size << 32);
+	ctx->hash[1] ^= node->node_offset;
+	ctx->hash[2] ^= (u64)node->node_depth ^ ((u64)node->inner_size << 8);
+}
+
+static void blake2b_final(crypto_blake2b_ctx *ctx, u8 *hash, int is_last_node)
+{
+	blake2b_compress(ctx, 1, is_last_node); // compress the last block
 	size_t hash_size = MIN(ctx->hash_size, 64);
 	size_t nb_words  = hash_size >> 3;
 	store64_le_buf(hash, ctx->hash, nb_words);
@@ -635,6 +1149,16 @@ void crypto_blake2b_final(crypto_blake2b_ctx *ctx, u8 *hash)
 	WIPE_CTX(ctx);
 }
 
+void crypto_blake2b_final(crypto_blake2b_ctx *ctx, u8 *hash)
+{
+	blake2b_final(ctx, hash, 0);
+}
+
+void crypto_blake2b_final_last_node(crypto_blake2b_ctx *ctx, u8 *hash)
+{
+	blake2b_final(ctx, hash, 1);
+}
+
 void crypto_blake2b_keyed(u8 *hash,          size_t hash_size,
                           const u8 *key,     size_t key_size,
                           const u8 *message, size_t message_size)
@@ -742,12 +1266,313 @@ static void g_rounds(blk *b)
 	}
 }
 
+#ifdef MONOCYPHER_AVX2
+// The 16 words of a ROUND are held as 4 rows of 4 words: the G functions
+// on the columns run in parallel, then the rows are rotated so the
+// diagonals line up as columns (as in blake2b_compress_avx2()).
+// LSB(a) * LSB(b) is exactly what _mm256_mul_epu32() computes.
+#define BLAMKA_AVX2(a, b) \
+	_mm256_add_epi64(_mm256_add_epi64(a, b), \
+	                 _mm256_slli_epi64(_mm256_mul_epu32(a, b), 1))
+#define G_AVX2(a, b, c, d)	\
+	a = BLAMKA_AVX2(a, b);  d = ROTR32_AVX2(_mm256_xor_si256(d, a)); \
+	c = BLAMKA_AVX2(c, d);  b = ROTR24_AVX2(_mm256_xor_si256(b, c)); \
+	a = BLAMKA_AVX2(a, b);  d = ROTR16_AVX2(_mm256_xor_si256(d, a)); \
+	c = BLAMKA_AVX2(c, d);  b = ROTR63_AVX2(_mm256_xor_si256(b, c))
+#define ROUND_AVX2(a, b, c, d)	\
+	G_AVX2(a, b, c, d);  DIAGONALIZE_AVX2(b, c, d); \
+	G_AVX2(a, b, c, d);  UNDIAGONALIZE_AVX2(b, c, d)
+
+// Words i, i+1 in the low half, words i+16, i+17 in the high half
+#define LOAD_PAIRS_AVX2(p)	\
+	_mm256_inserti128_si256(_mm256_castsi128_si256(            \
+		_mm_loadu_si128((const __m128i*)(p))),                 \
+		_mm_loadu_si128((const __m128i*)((p) + 16)), 1)
+#define STORE_PAIRS_AVX2(p, x)	\
+	_mm_storeu_si128((__m128i*)(p)       , _mm256_castsi256_si128(x)); \
+	_mm_storeu_si128((__m128i*)((p) + 16), _mm256_extracti128_si256(x, 1))
+
+// Same as g_rounds()
+AVX2_TARGET
+static void g_rounds_avx2(blk *b)
+{
+	ROTR_AVX2_MASKS;
+	__m256i *v = (__m256i*)b->a;
+
+	// column rounds: 16 consecutive words
+	for (int i = 0; i < 32; i += 4) {
+		__m256i a = _mm256_loadu_si256(v + i    );
+		__m256i x = _mm256_loadu_si256(v + i + 1);
+		__m256i c = _mm256_loadu_si256(v + i + 2);
+		__m256i d = _mm256_loadu_si256(v + i + 3);
+		ROUND_AVX2(a, x, c, d);
+		_mm256_storeu_si256(v + i    , a);
+		_mm256_storeu_si256(v + i + 1, x);
+		_mm256_storeu_si256(v + i + 2, c);
+		_mm256_storeu_si256(v + i + 3, d);
+	}
+	// row rounds: pairs of words, 16 apart
+	for (int i = 0; i < 16; i += 2) {
+		u64 *p = b->a + i;
+		__m256i a = LOAD_PAIRS_AVX2(p     );
+		__m256i x = LOAD_PAIRS_AVX2(p + 32);
+		__m256i c = LOAD_PAIRS_AVX2(p + 64);
+		__m256i d = LOAD_PAIRS_AVX2(p + 96);
+		ROUND_AVX2(a, x, c, d);
+		STORE_PAIRS_AVX2(p     , a);
+		STORE_PAIRS_AVX2(p + 32, x);
+		STORE_PAIRS_AVX2(p + 64, c);
+		STORE_PAIRS_AVX2(p + 96, d);
+	}
+}
+
+// Same as fill_block()
+AVX2_TARGET
+static void fill_block_avx2(blk *current, const blk *previous,
+                            const blk *reference, blk *tmp, int overwrite)
+{
+	const __m256i *p = (const __m256i*)previous->a;
+	const __m256i *r = (const __m256i*)reference->a;
+	__m256i       *c = (__m256i*)current->a;
+	__m256i       *t = (__m256i*)tmp->a;
+	FOR (i, 0, 32) {
+		__m256i x = _mm256_xor_si256(_mm256_loadu_si256(p + i),
+		                             _mm256_loadu_si256(r + i));
+		_mm256_storeu_si256(t + i, x);
+		if (!overwrite) {
+			x = _mm256_xor_si256(x, _mm256_loadu_si256(c + i));
+		}
+		_mm256_storeu_si256(c + i, x);
+	}
+	g_rounds_avx2(tmp);
+	FOR (i, 0, 32) {
+		_mm256_storeu_si256(c + i, _mm256_xor_si256(_mm256_loadu_si256(c + i),
+		                                            _mm256_loadu_si256(t + i)));
+	}
+}
+#endif // MONOCYPHER_AVX2
+
+// Shuffle the previous & reference block into the current block.
+// On the first pass the current block is overwritten, on later passes
+// the result is XORed into it.  'tmp' is scratch space.
+static void fill_block(blk *current, const blk *previous,
+                       const blk *reference, blk *tmp, int overwrite,
+                       int avx2)
+{
+#ifdef MONOCYPHER_AVX2
+	if (avx2) {
+		fill_block_avx2(current, previous, reference, tmp, overwrite);
+		return;
+	}
+#endif
+	(void)avx2;
+	copy_block(tmp, previous);
+	xor_block (tmp, reference);
+	if (overwrite) { copy_block(current, tmp); }
+	else           { xor_block (current, tmp); }
+	g_rounds  (tmp);
+	xor_block (current, tmp);
+}
+
+// g_rounds(), vectorised when 'avx2' is set
+static void g_rounds_dispatch(blk *b, int avx2)
+{
+#ifdef MONOCYPHER_AVX2
+	if (avx2) {
+		g_rounds_avx2(b);
+		return;
+	}
+#endif
+	(void)avx2;
+	g_rounds(b);
+}
+
 const crypto_argon2_extras crypto_argon2_no_extras = { 0, 0, 0, 0 };
 
+// rmonocypher: state shared by all segments of a slice
+typedef struct {
+	blk *blocks;
+	crypto_argon2_config config;
+	u32 nb_blocks;
+	u32 lane_size;
+	u32 segment_size;
+	u32 pass;
+	u32 slice;
+} argon2_slice;
+
+// rmonocypher: reference blocks are random accesses into a work area far
+// bigger than the cache, so they are prefetched ahead of use.
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(p) __builtin_prefetch(p, 0, 3)
+#else
+#define PREFETCH(p) (void)(p)
+#endif
+
+// How many blocks ahead to prefetch when the indices are known in advance
+#define ARGON2_PREFETCH_DISTANCE 4
+
+static void prefetch_block(const blk *b)
+{
+	FOR (i, 0, sizeof(blk) / 64) {
+		PREFETCH((const u8*)b + i * 64);
+	}
+}
+
+// Index of the reference block for 'block' within the current segment,
+// given its pseudo-random seed.
+static u32 argon2_reference(const argon2_slice *s, u32 segment, u32 block,
+                            u64 index_seed)
+{
+	const u32 pass         = s->pass;
+	const u32 slice        = s->slice;
+	const u32 segment_size = s->segment_size;
+	const u32 lane_size    = s->lane_size;
+
+	// Establish the reference set.  *Approximately* comprises:
+	// - The last 3 slices (if they exist yet)
+	// - The already constructed blocks in the current segment
+	u32 next_slice   = ((slice + 1) % 4) * segment_size;
+	u32 window_start = pass == 0 ? 0     : next_slice;
+	u32 nb_segments  = pass == 0 ? slice : 3;
+	u64 lane         =
+		pass == 0 && slice == 0
+		? segment
+		: (index_seed >> 32) % s->config.nb_lanes;
+	u32 window_size  =
+		nb_segments * segment_size +
+		(lane  == segment ? block-1 :
+		 block == 0       ? (u32)-1 : 0);
+
+	// Find reference block
+	u64  j1        = index_seed & 0xffffffff; // block selector
+	u64  x         = (j1 * j1)         >> 32;
+	u64  y         = (window_size * x) >> 32;
+	u64  z         = (window_size - 1) - y;
+	u64  ref       = (window_start + z) % lane_size;
+	return (u32)(lane * lane_size) + (u32)ref;
+}
+
+// Fill one segment (the part of a lane within the current slice).
+// Segments of the same slice only reference blocks of their own lane, or
+// blocks in previous slices, so they can be filled at the same time.
+static void argon2_segment(void *arg, size_t segment_idx)
+{
+	const argon2_slice *s = (const argon2_slice*)arg;
+	const crypto_argon2_config config = s->config;
+	const u32 segment      = (u32)segment_idx;
+	const u32 pass         = s->pass;
+	const u32 slice        = s->slice;
+	const u32 segment_size = s->segment_size;
+	const u32 lane_size    = s->lane_size;
+	blk      *blocks       = s->blocks;
+	const int avx2         = crypto_simd_avx2();
+
+	// Argon2i and Argon2id start with constant time indexing.
+	// Argon2id switches back to non-constant time indexing
+	// after the first two slices of the first pass
+	int constant_time =
+		config.algorithm == CRYPTO_ARGON2_I ||
+		(config.algorithm == CRYPTO_ARGON2_ID && pass == 0 && slice < 2);
+
+	// On the first slice of the first pass,
+	// blocks 0 and 1 are already filled, hence pass_offset.
+	u32 pass_offset  = pass == 0 && slice == 0 ? 2 : 0;
+	u32 slice_offset = slice * segment_size;
+
+	blk tmp;
+	blk index_block;
+	u32 index_ctr = 1;
+	FOR_T (u32, block, pass_offset, segment_size) {
+		// Current and previous blocks
+		u32  lane_offset   = segment * lane_size;
+		blk *segment_start = blocks + lane_offset + slice_offset;
+		blk *current       = segment_start + block;
+		blk *previous      =
+			block == 0 && slice_offset == 0
+			? segment_start + lane_size - 1
+			: segment_start + block - 1;
+
+		u64 index_seed;
+		if (constant_time) {
+			// Indices of the same 128 block group come from the same
+			// index block, so we can prefetch up to its end.
+			u32 group_end = MIN(block - block % 128 + 128, segment_size);
+
+			if (block == pass_offset || (block % 128) == 0) {
+				// Fill or refresh deterministic indices block
+
+				// seed the beginning of the block...
+				ZERO(index_block.a, 128);
+				index_block.a[0] = pass;
+				index_block.a[1] = segment;
+				index_block.a[2] = slice;
+				index_block.a[3] = s->nb_blocks;
+				index_block.a[4] = config.nb_passes;
+				index_block.a[5] = config.algorithm;
+				index_block.a[6] = index_ctr;
+				index_ctr++;
+
+				// ... then shuffle it
+				copy_block(&tmp, &index_block);
+				g_rounds_dispatch(&index_block, avx2);
+				xor_block (&index_block, &tmp);
+				copy_block(&tmp, &index_block);
+				g_rounds_dispatch(&index_block, avx2);
+				xor_block (&index_block, &tmp);
+
+				// Prefetch the first few references of the group
+				u32 end = MIN(block + ARGON2_PREFETCH_DISTANCE, group_end);
+				FOR_T (u32, b, block, end) {
+					u32 r = argon2_reference(s, segment, b, index_block.a[b % 128]);
+					prefetch_block(blocks + r);
+				}
+			}
+
+			// Keep the prefetches a few blocks ahead
+			u32 ahead = block + ARGON2_PREFETCH_DISTANCE;
+			if (ahead < group_end) {
+				u32 r = argon2_reference(s, segment, ahead, index_block.a[ahead % 128]);
+				prefetch_block(blocks + r);
+			}
+			index_seed = index_block.a[block % 128];
+		} else {
+			index_seed = previous->a[0];
+		}
+
+		blk *reference = blocks + argon2_reference(s, segment, block, index_seed);
+
+		// Shuffle the previous & reference block
+		// into the current block
+		fill_block(current, previous, reference, &tmp, pass == 0, avx2);
+
+		// Data dependent indexing: the next reference depends on the
+		// block we just filled.  Start fetching it right away.
+		if (!constant_time && block + 1 < segment_size) {
+			u32 r = argon2_reference(s, segment, block + 1, current->a[0]);
+			prefetch_block(blocks + r);
+		}
+	}
+
+	// Wipe temporary blocks
+	volatile u64* p = tmp.a;
+	ZERO(p, 128);
+	p = index_block.a;
+	ZERO(p, 128);
+}
+
 void crypto_argon2(u8 *hash, u32 hash_size, void *work_area,
                    crypto_argon2_config config,
                    crypto_argon2_inputs inputs,
                    crypto_argon2_extras extras)
+{
+	crypto_argon2_threaded(hash, hash_size, work_area, config, inputs, extras, 1);
+}
+
+void crypto_argon2_threaded(u8 *hash, u32 hash_size, void *work_area,
+                            crypto_argon2_config config,
+                            crypto_argon2_inputs inputs,
+                            crypto_argon2_extras extras,
+                            int nb_threads)
 {
 	const u32 segment_size = config.nb_blocks / config.nb_lanes / 4;
 	const u32 lane_size    = segment_size * 4;
@@ -786,118 +1611,27 @@ void crypto_argon2(u8 *hash, u32 hash_size, void *work_area,
 		WIPE_BUFFER(hash_area);
 	}
 
-	// Argon2i and Argon2id start with constant time indexing
-	int constant_time = config.algorithm != CRYPTO_ARGON2_D;
-
 	// Fill (and re-fill) the rest of the blocks
 	//
-	// Note: even though each segment within the same slice can be
-	// computed in parallel, (one thread per lane), we are computing
-	// them sequentially, because Monocypher doesn't support threads.
-	//
-	// Yet optimal performance (and therefore security) requires one
-	// thread per lane. The only reason Monocypher supports multiple
-	// lanes is compatibility.
-	blk tmp;
+	// rmonocypher: each segment within the same slice is computed in
+	// its own thread (one lane per thread).  All segments must be fully
+	// completed before we start filling the next slice, so parallel_for()
+	// acts as a barrier.
+	argon2_slice s = {
+		.blocks       = blocks,
+		.config       = config,
+		.nb_blocks    = nb_blocks,
+		.lane_size    = lane_size,
+		.segment_size = segment_size,
+	};
 	FOR_T(u32, pass, 0, config.nb_passes) {
 		FOR_T(u32, slice, 0, 4) {
-			// On the first slice of the first pass,
-			// blocks 0 and 1 are already filled, hence pass_offset.
-			u32 pass_offset  = pass == 0 && slice == 0 ? 2 : 0;
-			u32 slice_offset = slice * segment_size;
-
-			// Argon2id switches back to non-constant time indexing
-			// after the first two slices of the first pass
-			if (slice == 2 && config.algorithm == CRYPTO_ARGON2_ID) {
-				constant_time = 0;
-			}
-
-			// Each iteration of the following loop may be performed in
-			// a separate thread.  All segments must be fully completed
-			// before we start filling the next slice.
-			FOR_T(u32, segment, 0, config.nb_lanes) {
-				blk index_block;
-				u32 index_ctr = 1;
-				FOR_T (u32, block, pass_offset, segment_size) {
-					// Current and previous blocks
-					u32  lane_offset   = segment * lane_size;
-					blk *segment_start = blocks + lane_offset + slice_offset;
-					blk *current       = segment_start + block;
-					blk *previous      =
-						block == 0 && slice_offset == 0
-						? segment_start + lane_size - 1
-						: segment_start + block - 1;
-
-					u64 index_seed;
-					if (constant_time) {
-						if (block == pass_offset || (block % 128) == 0) {
-							// Fill or refresh deterministic indices block
-
-							// seed the beginning of the block...
-							ZERO(index_block.a, 128);
-							index_block.a[0] = pass;
-							index_block.a[1] = segment;
-							index_block.a[2] = slice;
-							index_block.a[3] = nb_blocks;
-							index_block.a[4] = config.nb_passes;
-							index_block.a[5] = config.algorithm;
-							index_block.a[6] = index_ctr;
-							index_ctr++;
-
-							// ... then shuffle it
-							copy_block(&tmp, &index_block);
-							g_rounds  (&index_block);
-							xor_block (&index_block, &tmp);
-							copy_block(&tmp, &index_block);
-							g_rounds  (&index_block);
-							xor_block (&index_block, &tmp);
-						}
-						index_seed = index_block.a[block % 128];
-					} else {
-						index_seed = previous->a[0];
-					}
-
-					// Establish the reference set.  *Approximately* comprises:
-					// - The last 3 slices (if they exist yet)
-					// - The already constructed blocks in the current segment
-					u32 next_slice   = ((slice + 1) % 4) * segment_size;
-					u32 window_start = pass == 0 ? 0     : next_slice;
-					u32 nb_segments  = pass == 0 ? slice : 3;
-					u64 lane         =
-						pass == 0 && slice == 0
-						? segment
-						: (index_seed >> 32) % config.nb_lanes;
-					u32 window_size  =
-						nb_segments * segment_size +
-						(lane  == segment ? block-1 :
-						 block == 0       ? (u32)-1 : 0);
-
-					// Find reference block
-					u64  j1        = index_seed & 0xffffffff; // block selector
-					u64  x         = (j1 * j1)         >> 32;
-					u64  y         = (window_size * x) >> 32;
-					u64  z         = (window_size - 1) - y;
-					u64  ref       = (window_start + z) % lane_size;
-					u32  index     = (u32)(lane * lane_size) + (u32)ref;
-					blk *reference = blocks + index;
-
-					// Shuffle the previous & reference block
-					// into the current block
-					copy_block(&tmp, previous);
-					xor_block (&tmp, reference);
-					if (pass == 0) { copy_block(current, &tmp); }
-					else           { xor_block (current, &tmp); }
-					g_rounds  (&tmp);
-					xor_block (current, &tmp);
-				}
-			}
+			s.pass  = pass;
+			s.slice = slice;
+			parallel_for(config.nb_lanes, nb_threads, argon2_segment, &s);
 		}
 	}
 
-	// Wipe temporary block
-	volatile u64* p = tmp.a;
-	ZERO(p, 128);
-
 	// XOR last blocks of each lane
 	blk *last_block = blocks + lane_size - 1;
 	FOR_T (u32, lane, 1, config.nb_lanes) {
@@ -911,8 +1645,7 @@ void crypto_argon2(u8 *hash, u32 hash_size, void *work_area,
 	store64_le_buf(final_block, last_block->a, 128);
 
 	// Wipe work area
-	p = (u64*)work_area;
-	ZERO(p, 128 * nb_blocks);
+	crypto_wipe(work_area, (size_t)nb_blocks * 1024);
 
 	// Hash the very last block with H' into the output hash
 	extended_hash(hash, hash_size, final_block, 1024);
@@ -2855,21 +3588,29 @@ void crypto_x25519_inverse(u8 blind_salt [32], const u8 private_key[32],
 ////////////////////////////////
 /// Authenticated encryption ///
 ////////////////////////////////
-static void lock_auth(u8 mac[16], const u8  auth_key[32],
-                      const u8 *ad         , size_t ad_size,
-                      const u8 *cipher_text, size_t text_size)
+// rmonocypher: the authenticator is split into start/finish, so the cipher
+// text can be fed to Poly1305 in tiles as it is encrypted/decrypted.
+// Tiles are a multiple of the ChaCha20 block size, so the counter of each
+// tile follows on from the previous one.
+#define AEAD_TILE_SIZE (16 * 1024)
+
+static void auth_start(crypto_poly1305_ctx *poly_ctx, const u8 auth_key[32],
+                       const u8 *ad, size_t ad_size)
+{
+	crypto_poly1305_init  (poly_ctx, auth_key);
+	crypto_poly1305_update(poly_ctx, ad         , ad_size);
+	crypto_poly1305_update(poly_ctx, zero       , gap(ad_size, 16));
+}
+
+static void auth_finish(crypto_poly1305_ctx *poly_ctx, u8 mac[16],
+                        size_t ad_size, size_t text_size)
 {
 	u8 sizes[16]; // Not secret, not wiped
 	store64_le(sizes + 0, ad_size);
 	store64_le(sizes + 8, text_size);
-	crypto_poly1305_ctx poly_ctx;           // auto wiped...
-	crypto_poly1305_init  (&poly_ctx, auth_key);
-	crypto_poly1305_update(&poly_ctx, ad         , ad_size);
-	crypto_poly1305_update(&poly_ctx, zero       , gap(ad_size, 16));
-	crypto_poly1305_update(&poly_ctx, cipher_text, text_size);
-	crypto_poly1305_update(&poly_ctx, zero       , gap(text_size, 16));
-	crypto_poly1305_update(&poly_ctx, sizes      , 16);
-	crypto_poly1305_final (&poly_ctx, mac); // ...here
+	crypto_poly1305_update(poly_ctx, zero       , gap(text_size, 16));
+	crypto_poly1305_update(poly_ctx, sizes      , 16);
+	crypto_poly1305_final (poly_ctx, mac); // ...here
 }
 
 void crypto_aead_init_x(crypto_aead_ctx *ctx,
@@ -2902,9 +3643,21 @@ void crypto_aead_write(crypto_aead_ctx *ctx, u8 *cipher_text, u8 mac[16],
 {
 	u8 auth_key[64]; // the last 32 bytes are used for rekeying.
 	crypto_chacha20_djb(auth_key, 0, 64, ctx->key, ctx->nonce, ctx->counter);
-	crypto_chacha20_djb(cipher_text, plain_text, text_size,
-	                    ctx->key, ctx->nonce, ctx->counter + 1);
-	lock_auth(mac, auth_key, ad, ad_size, cipher_text, text_size);
+
+	// Encrypt one tile at a time, and authenticate it while it is still
+	// in cache.  Same output as encrypting everything, then authenticating.
+	crypto_poly1305_ctx poly_ctx;           // auto wiped...
+	auth_start(&poly_ctx, auth_key, ad, ad_size);
+	u64 ctr = ctx->counter + 1;
+	for (size_t pos = 0; pos < text_size; pos += AEAD_TILE_SIZE) {
+		size_t tile = MIN(AEAD_TILE_SIZE, text_size - pos);
+		ctr = crypto_chacha20_djb(cipher_text + pos,
+		                          plain_text == 0 ? 0 : plain_text + pos, tile,
+		                          ctx->key, ctx->nonce, ctr);
+		crypto_poly1305_update(&poly_ctx, cipher_text + pos, tile);
+	}
+	auth_finish(&poly_ctx, mac, ad_size, text_size);
+
 	COPY(ctx->key, auth_key + 32, 32);
 	WIPE_BUFFER(auth_key);
 }
@@ -2916,12 +3669,27 @@ int crypto_aead_read(crypto_aead_ctx *ctx, u8 *plain_text, const u8 mac[16],
 	u8 auth_key[64]; // the last 32 bytes are used for rekeying.
 	u8 real_mac[16];
 	crypto_chacha20_djb(auth_key, 0, 64, ctx->key, ctx->nonce, ctx->counter);
-	lock_auth(real_mac, auth_key, ad, ad_size, cipher_text, text_size);
+
+	// Authenticate and decrypt one tile at a time, so the cipher text is
+	// only read from memory once.  Each tile is authenticated before it is
+	// decrypted, which also allows decrypting in place.
+	crypto_poly1305_ctx poly_ctx;           // auto wiped...
+	auth_start(&poly_ctx, auth_key, ad, ad_size);
+	u64 ctr = ctx->counter + 1;
+	for (size_t pos = 0; pos < text_size; pos += AEAD_TILE_SIZE) {
+		size_t tile = MIN(AEAD_TILE_SIZE, text_size - pos);
+		crypto_poly1305_update(&poly_ctx, cipher_text + pos, tile);
+		ctr = crypto_chacha20_djb(plain_text + pos, cipher_text + pos, tile,
+		                          ctx->key, ctx->nonce, ctr);
+	}
+	auth_finish(&poly_ctx, real_mac, ad_size, text_size);
+
+	// Forged messages never reveal any plain text
 	int mismatch = crypto_verify16(mac, real_mac);
 	if (!mismatch) {
-		crypto_chacha20_djb(plain_text, cipher_text, text_size,
-		                    ctx->key, ctx->nonce, ctx->counter + 1);
 		COPY(ctx->key, auth_key + 32, 32);
+	} else if (text_size > 0) {
+		crypto_wipe(plain_text, text_size);
 	}
 	WIPE_BUFFER(auth_key);
 	WIPE_BUFFER(real_mac);
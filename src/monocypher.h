@@ -77,6 +77,15 @@ int crypto_verify64(const uint8_t a[64], const uint8_t b[64]);
 void crypto_wipe(void *secret, size_t size);
 
 
+// Runtime dispatch (rmonocypher)
+// ------------------------------
+// Vectorised code is only used when 'crypto_simd_enabled' is non-zero and
+// the CPU supports it.  Setting it to zero also selects the portable 32-bit
+// Poly1305 code on 64-bit targets.  Output is identical either way.
+extern int crypto_simd_enabled;
+int crypto_simd_avx2(void);
+
+
 // Authenticated encryption
 // ------------------------
 void crypto_aead_lock(uint8_t       *cipher_text,
@@ -117,6 +126,9 @@ int crypto_aead_read(crypto_aead_ctx *ctx,
                      const uint8_t    mac[16],
                      const uint8_t   *ad        , size_t ad_size,
                      const uint8_t   *cipher_text, size_t text_size);
+// rmonocypher: crypto_aead_read() and crypto_aead_unlock() decrypt while
+// authenticating.  If authentication fails, 'plain_text' is wiped (so
+// decrypting in place destroys the cipher text).
 
 
 // General purpose hash (BLAKE2b)
@@ -148,6 +160,28 @@ void crypto_blake2b_update(crypto_blake2b_ctx *ctx,
                            const uint8_t *message, size_t message_size);
 void crypto_blake2b_final(crypto_blake2b_ctx *ctx, uint8_t *hash);
 
+// Tree hashing (rmonocypher)
+// Parameters of a node in a hash tree, as in section 2.5 of the BLAKE2 
+// spec.  'digest_size' and 'key_size' are only written to the parameter
+// block: they need not match the actual output size and key (BLAKE2bp 
+// leaves output 64 bytes, and its root is not keyed).  The last node 
+// of each level of the tree is finalised with the last node flag set.
+typedef struct {
+	uint64_t node_offset;
+	uint32_t leaf_size;
+	uint8_t  digest_size;
+	uint8_t  key_size;
+	uint8_t  fanout;
+	uint8_t  depth;
+	uint8_t  node_depth;
+	uint8_t  inner_size;
+} crypto_blake2b_node;
+
+void crypto_blake2b_node_init(crypto_blake2b_ctx *ctx, size_t hash_size,
+                              const uint8_t *key, size_t key_size,
+                              const crypto_blake2b_node *node);
+void crypto_blake2b_final_last_node(crypto_blake2b_ctx *ctx, uint8_t *hash);
+
 
 // Password key derivation (Argon2)
 // --------------------------------
@@ -183,6 +217,15 @@ void crypto_argon2(uint8_t *hash, uint32_t hash_size, void *work_area,
                    crypto_argon2_inputs inputs,
                    crypto_argon2_extras extras);
 
+// rmonocypher: same as crypto_argon2(), but the lanes of each slice are
+// filled by up to 'nb_threads' threads.  The hash doesn't depend on the
+// number of threads.
+void crypto_argon2_threaded(uint8_t *hash, uint32_t hash_size, void *work_area,
+                            crypto_argon2_config config,
+                            crypto_argon2_inputs inputs,
+                            crypto_argon2_extras extras,
+                            int nb_threads);
+
 
 // Key exchange (X-25519)
 // ----------------------
@@ -0,0 +1,101 @@
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "parallel.h"
+
+// Not using the R API in this file. 'fn' is called from worker threads, so
+// it must not call any R API functions either.
+
+typedef struct {
+  pthread_mutex_t lock;
+  size_t next;
+  size_t n;
+  parallel_fn fn;
+  void *arg;
+} parallel_pool;
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Each worker repeatedly claims the next unprocessed item, so items of
+// uneven cost are balanced across threads.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void *parallel_worker(void *data) {
+  parallel_pool *pool = (parallel_pool *)data;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    size_t i = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if (i >= pool->n) break;
+    pool->fn(pool->arg, i);
+  }
+
+  return NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Call fn(arg, i) for i = 0 .. n-1 using up to 'nthreads' threads.
+//
+// The calling thread also does work, and returns once all items are
+// complete.  If threads can't be created, the remaining work is just done
+// on fewer threads.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void parallel_for(size_t n, int nthreads, parallel_fn fn, void *arg) {
+
+  if (nthreads <= 1 || n <= 1) {
+    for (size_t i = 0; i < n; i++) {
+      fn(arg, i);
+    }
+    return;
+  }
+
+  if ((size_t)nthreads > n) {
+    nthreads = (int)n;
+  }
+
+  parallel_pool pool = { .next = 0, .n = n, .fn = fn, .arg = arg };
+  pthread_mutex_init(&pool.lock, NULL);
+
+  pthread_t *threads = malloc((size_t)(nthreads - 1) * sizeof(pthread_t));
+  int nstarted = 0;
+  if (threads != NULL) {
+    for (int t = 0; t < nthreads - 1; t++) {
+      if (pthread_create(&threads[t], NULL, parallel_worker, &pool) != 0) break;
+      nstarted++;
+    }
+  }
+
+  parallel_worker(&pool);
+
+  for (int t = 0; t < nstarted; t++) {
+    pthread_join(threads[t], NULL);
+  }
+
+  free(threads);
+  pthread_mutex_destroy(&pool.lock);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Number of CPU cores available. At least 1
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int parallel_ncores(void) {
+#if defined(_WIN32)
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  long n = (long)si.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  return n > 0 ? (int)n : 1;
+}
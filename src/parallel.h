@@ -0,0 +1,7 @@
+
+#include <stddef.h>
+
+typedef void (*parallel_fn)(void *arg, size_t i);
+
+void parallel_for(size_t n, int nthreads, parallel_fn fn, void *arg);
+int  parallel_ncores(void);
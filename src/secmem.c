@@ -0,0 +1,93 @@
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#include "monocypher.h"
+#include "secmem.h"
+
+// Not using the R API in this file.  Callers decide how to report failure.
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Round up to a whole number of pages. Locking works on whole pages, 
+// so secrets never share a page with other heap data.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t page_round(size_t n) {
+#if defined(_WIN32)
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  size_t page = (size_t)si.dwPageSize;
+#else
+  long sz = sysconf(_SC_PAGESIZE);
+  size_t page = sz > 0 ? (size_t)sz : 4096;
+#endif
+  return (n + page - 1) / page * page;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Allocate zeroed memory for holding secrets
+//
+// The memory is locked so it is never written to swap, and on Linux it is
+// also excluded from core dumps.
+//
+// @param n number of bytes
+// @return pointer to memory, or NULL if it couldn't be allocated or locked
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void *secmem_alloc(size_t n) {
+  size_t len = page_round(n);
+
+#if defined(_WIN32)
+  void *p = VirtualAlloc(NULL, len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (p == NULL) return NULL;
+  if (!VirtualLock(p, len)) {
+    VirtualFree(p, 0, MEM_RELEASE);
+    return NULL;
+  }
+#else
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+  if (mlock(p, len) != 0) {
+    munmap(p, len);
+    return NULL;
+  }
+#if defined(MADV_DONTDUMP)
+  madvise(p, len, MADV_DONTDUMP);
+#endif
+#endif
+
+  return p;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Wipe, unlock and release memory from secmem_alloc()
+//
+// @param p pointer returned by secmem_alloc(). May be NULL
+// @param n the size originally requested
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void secmem_free(void *p, size_t n) {
+  if (p == NULL) return;
+  size_t len = page_round(n);
+  crypto_wipe(p, len);
+
+#if defined(_WIN32)
+  VirtualUnlock(p, len);
+  VirtualFree(p, 0, MEM_RELEASE);
+#else
+  munlock(p, len);
+  munmap(p, len);
+#endif
+}
@@ -0,0 +1,4 @@
+#include <stddef.h>
+
+void *secmem_alloc(size_t n);
+void secmem_free(void *p, size_t n);
@@ -0,0 +1,444 @@
+#define R_NO_REMAP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include "monocypher.h"
+#include "utils.h"
+#include "rbyte.h"
+#include "stream.h"
+#include "mapfile.h"
+#include "compress.h"
+
+SEXP open_stream_src(SEXP src_, SEXP key_, SEXP additional_data_, SEXP threads_, SEXP kdf_,
+                     const char *caller, stream_reader *r, mapped_file *mf);
+void stream_info_init(stream_info *info, int content, int codec, SEXP key_,
+                      const argon_params *params);
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Serialize an R object straight into an encrypted stream
+//
+// R's serializer writes through an output stream (R_InitOutPStream) whose
+// callbacks feed the bytes to the stream writer.  The serialized object is
+// never held in memory as a whole - only the chunks waiting to be sealed.
+//
+// Without compression, the output is identical in format to
+//   encrypt_stream_(serialize(robj, NULL, xdr = FALSE), ...)
+//
+// With compression, the serialized bytes pass through a block compressor
+// (see compress.h) on their way to the stream writer.
+//
+// In memory output without compression is written straight into a raw
+// vector of the exact size, found by serializing once just to count the
+// bytes.  The size of compressed output isn't known in advance, so it is
+// written to a growing buffer and copied to a raw vector at the end.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  SEXP robj_;
+  SEXP res_;            // in memory output of known size. Or R_NilValue
+  int is_file;
+  const char *filename;
+  const char *tmpname;  // written first, then renamed to 'filename'. NULL once 
+                        // done, or if 'filename' isn't a regular file
+  int codec;
+  zblock_writer z;
+  stream_writer w;
+} serialize_state;
+
+
+// A failure writing compressed data is reported as the stream writer's error
+static const char *serialize_err(serialize_state *s) {
+  return s->w.err != NULL ? s->w.err : s->z.err;
+}
+
+static int stream_sink(void *ctx, const uint8_t *data, size_t n) {
+  return stream_writer_update((stream_writer *)ctx, data, n);
+}
+
+static void out_bytes(R_outpstream_t stream, void *buf, int n) {
+  serialize_state *s = (serialize_state *)stream->data;
+  if (n <= 0) return;
+  int status = s->codec ?
+    zblock_writer_update(&s->z, (const uint8_t *)buf, (size_t)n) :
+    stream_writer_update(&s->w, (const uint8_t *)buf, (size_t)n);
+  if (status < 0) {
+    Rf_error("encrypt_serialize_(): %s", serialize_err(s));
+  }
+}
+
+static void out_char(R_outpstream_t stream, int c) {
+  uint8_t b = (uint8_t)c;
+  out_bytes(stream, &b, 1);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Size of the serialized object, without keeping any of it
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void count_bytes(R_outpstream_t stream, void *buf, int n) {
+  if (n > 0) *(size_t *)stream->data += (size_t)n;
+}
+
+static void count_char(R_outpstream_t stream, int c) {
+  count_bytes(stream, NULL, 1);
+}
+
+static size_t serialized_size(SEXP robj_) {
+  size_t size = 0;
+  struct R_outpstream_st stream;
+  R_InitOutPStream(&stream, (R_pstream_data_t)&size, R_pstream_binary_format, 3,
+                   count_char, count_bytes, NULL, R_NilValue);
+  R_Serialize(robj_, &stream);
+  return size;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Serialize, then seal the final frame.  Run by R_ExecWithCleanup() so
+// the writer is always freed, even if serialization raises an error.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static SEXP serialize_body(void *data) {
+  serialize_state *s = (serialize_state *)data;
+  
+  if (s->codec && zblock_writer_init(&s->z, s->codec, ZBLOCK_SIZE, s->w.nthreads, stream_sink, &s->w) < 0) {
+    Rf_error("encrypt_serialize_(): %s", serialize_err(s));
+  }
+  
+  struct R_outpstream_st stream;
+  R_InitOutPStream(&stream, (R_pstream_data_t)s, R_pstream_binary_format, 3,
+                   out_char, out_bytes, NULL, R_NilValue);
+  R_Serialize(s->robj_, &stream);
+  
+  if (s->codec && zblock_writer_final(&s->z) < 0) {
+    Rf_error("encrypt_serialize_(): %s", serialize_err(s));
+  }
+  if (stream_writer_final(&s->w) < 0) {
+    Rf_error("encrypt_serialize_(): %s", s->w.err);
+  }
+  
+  if (s->is_file) {
+    int status = fclose(s->w.io.fp);
+    s->w.io.fp = NULL;
+    if (status != 0) {
+      Rf_error("encrypt_serialize_(): couldn't close file");
+    }
+    const char *tmpname = s->tmpname;
+    s->tmpname = NULL;
+    if (tmpname != NULL && replace_file(tmpname, s->filename) < 0) {
+      Rf_error("encrypt_serialize_(): couldn't rename temporary file to '%s'", s->filename);
+    }
+    return R_NilValue;
+  }
+  
+  if (!Rf_isNull(s->res_)) {
+    if (s->w.io.pos != s->w.io.len) {
+      Rf_error("encrypt_serialize_(): serialized size changed");
+    }
+    return s->res_;
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Compressed output is copied to a raw vector of the exact size
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  SEXP res_ = PROTECT(Rf_allocVector(RAWSXP, (R_xlen_t)s->w.io.pos));
+  memcpy(RAW(res_), s->w.io.buf, s->w.io.pos);
+  UNPROTECT(1);
+  return res_;
+}
+
+
+static void serialize_cleanup(void *data) {
+  serialize_state *s = (serialize_state *)data;
+  zblock_writer_free(&s->z);
+  stream_writer_free(&s->w);
+  if (s->w.io.grow) {
+    free(s->w.io.buf);
+    s->w.io.buf = NULL;
+  } else if (s->tmpname != NULL) {
+    // Failed or interrupted. 'dst' is untouched
+    remove(s->tmpname);
+    s->tmpname = NULL;
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Serialize and encrypt an R object
+//
+// @param robj_ R object
+// @param dst_ filename or NULL.  If NULL, return a raw vector
+// @param key_ 32 bytes.  Raw vector. Or hex string. Or password to feed to
+//        argon2()
+// @param additional_data_ data used for message authentication, but not
+//        encrypted or included with encrypted output
+// @param compress_ 'none', 'gzip', 'bzip2' or 'xz'
+// @param threads_ number of threads.  If greater than 1, blocks are
+//        compressed, and chunks are sealed, in parallel
+// @param kdf_ Argon2 parameters used if 'key_' is a password. NULL for
+//        the defaults
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP encrypt_serialize_(SEXP robj_, SEXP dst_, SEXP key_, SEXP additional_data_, SEXP compress_, SEXP threads_, SEXP kdf_) {
+  
+  if (!Rf_isNull(dst_) && TYPEOF(dst_) != STRSXP) {
+    Rf_error("encrypt_serialize_(): 'dst' must be a filename or NULL");
+  }
+  if (TYPEOF(compress_) != STRSXP || Rf_length(compress_) != 1) {
+    Rf_error("encrypt_serialize_(): 'compress' must be a single string");
+  }
+  int codec = zblock_codec(CHAR(STRING_ELT(compress_, 0)));
+  if (codec < 0) {
+    Rf_error("encrypt_serialize_(): Unknown compression type '%s'", CHAR(STRING_ELT(compress_, 0)));
+  }
+  
+  uint8_t *ad = NULL;
+  size_t ad_len = 0;
+  unpack_additional_data(additional_data_, &ad, &ad_len);
+  int threads = unpack_threads(threads_);
+  argon_params params;
+  unpack_argon_params(kdf_, &params);
+  
+  serialize_state s;
+  memset(&s, 0, sizeof(s));
+  s.robj_ = robj_;
+  s.res_  = R_NilValue;
+  s.codec = codec;
+  
+  uint8_t nonce[STREAM_NONCESIZE];
+  rbyte(nonce, STREAM_NONCESIZE);
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Output is either a raw vector of the exact size (no compression), a 
+  // growing memory buffer (compression), or a file.  Files are written
+  // to a temporary file in the same directory, which only replaces 'dst'
+  // once it is complete (devices and pipes are written directly).  The
+  // expanded filename is copied, as R_ExpandFileName() reuses its buffer.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (Rf_isNull(dst_) && codec == 0) {
+    size_t N = stream_encrypted_size(serialized_size(robj_), STREAM_CHUNKSIZE);
+    s.res_ = Rf_allocVector(RAWSXP, (R_xlen_t)N);
+    s.w.io.buf = RAW(s.res_);
+    s.w.io.len = N;
+  } else if (Rf_isNull(dst_)) {
+    s.w.io.grow = 1;
+  } else {
+    s.is_file = 1;
+    const char *filename = R_ExpandFileName(CHAR(STRING_ELT(dst_, 0)));
+    char *copy = R_alloc(strlen(filename) + 1, 1);
+    strcpy(copy, filename);
+    s.filename = copy;
+    s.tmpname  = temp_filename(copy);
+  }
+  PROTECT(s.res_);
+  
+  uint8_t key[32];
+  unpack_key(key_, &params, key);
+  
+  if (s.is_file) {
+    if (stream_io_open(&s.w.io, s.tmpname != NULL ? s.tmpname : s.filename, "wb") < 0) {
+      crypto_wipe(key, sizeof(key));
+      Rf_error("encrypt_serialize_(): Couldn't open file for writing '%s'", s.filename);
+    }
+  }
+  
+  stream_info info;
+  stream_info_init(&info, STREAM_CONTENT_SERIALIZED, codec, key_, &params);
+  int status = stream_writer_init(&s.w, key, nonce, ad, ad_len, STREAM_CHUNKSIZE, threads, &info);
+  crypto_wipe(key, sizeof(key));
+  
+  if (status < 0) {
+    const char *err = s.w.err;
+    serialize_cleanup(&s);
+    Rf_error("encrypt_serialize_(): %s", err);
+  }
+  
+  SEXP res_ = R_ExecWithCleanup(serialize_body, &s, serialize_cleanup, &s);
+  UNPROTECT(1);
+  return res_;
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Unserialize an R object straight from an encrypted stream
+//
+// R's unserializer reads through an input stream (R_InitInPStream) whose
+// callbacks pull frames from the stream reader as they are needed. Every
+// frame is authenticated before any of its bytes are handed to R, and the
+// end of the stream is checked before the object is returned.
+//
+// Block compressed data (see compress.h) is decompressed on the way.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  stream_reader r;
+  mapped_file mf;
+  int compressed;
+  zblock_reader z;
+  uint8_t peek[4];   // format bytes read to check how the data was written
+  size_t  peek_len;
+  size_t  peek_pos;
+} unserialize_state;
+
+
+// A failure reading compressed data is reported as the stream reader's error
+static const char *unserialize_err(unserialize_state *s) {
+  return s->r.err != NULL ? s->r.err : s->z.err;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decrypted plain text, starting with the bytes already peeked at
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int plain_read(void *ctx, uint8_t *dst, size_t n) {
+  unserialize_state *s = (unserialize_state *)ctx;
+  while (n > 0 && s->peek_pos < s->peek_len) {
+    *dst++ = s->peek[s->peek_pos++];
+    n--;
+  }
+  return n > 0 ? stream_reader_read(&s->r, dst, n) : 0;
+}
+
+static void in_bytes(R_inpstream_t stream, void *buf, int n) {
+  unserialize_state *s = (unserialize_state *)stream->data;
+  if (n <= 0) return;
+  int status = s->compressed ?
+    zblock_reader_read(&s->z, (uint8_t *)buf, (size_t)n) :
+    plain_read(s, (uint8_t *)buf, (size_t)n);
+  if (status < 0) {
+    Rf_error("decrypt_unserialize_(): %s", unserialize_err(s));
+  }
+}
+
+static int in_char(R_inpstream_t stream) {
+  uint8_t b;
+  in_bytes(stream, &b, 1);
+  return b;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Does the plain text start like the output of serialize()?
+// Compressed data never starts with one of these.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int is_serialized(const uint8_t *p) {
+  return (p[0] == 'A' || p[0] == 'B' || p[0] == 'X') && p[1] == '\n';
+}
+
+
+static SEXP unserialize_body(void *data) {
+  unserialize_state *s = (unserialize_state *)data;
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // The header records what the plain text is.  Streams with version 1
+  // headers don't, so look at the first few bytes instead.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  uint64_t total   = s->r.total;
+  int      content = s->r.info.content;
+  s->compressed    = s->r.info.codec != 0;
+  
+  if (content == STREAM_CONTENT_UNKNOWN) {
+    content = STREAM_CONTENT_RAW;
+    if (total >= sizeof(s->peek)) {
+      if (stream_reader_read(&s->r, s->peek, sizeof(s->peek)) < 0) {
+        Rf_error("decrypt_unserialize_(): %s", s->r.err);
+      }
+      s->peek_len = sizeof(s->peek);
+      s->compressed = zblock_is_zblock(s->peek, sizeof(s->peek));
+      if (s->compressed || is_serialized(s->peek)) {
+        content = STREAM_CONTENT_SERIALIZED;
+      }
+    }
+  }
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Anything else (e.g. data compressed by memCompress()) is returned as
+  // a raw vector
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (content != STREAM_CONTENT_SERIALIZED) {
+    SEXP res_ = PROTECT(Rf_allocVector(RAWSXP, (R_xlen_t)total));
+    uint8_t *plain_text = RAW(res_);
+    memcpy(plain_text, s->peek, s->peek_len);
+    
+    int status = stream_reader_read(&s->r, plain_text + s->peek_len, (size_t)total - s->peek_len);
+    if (status == 0) status = stream_reader_finish(&s->r);
+    if (status < 0) {
+      crypto_wipe(plain_text, (size_t)total);
+      Rf_error("decrypt_unserialize_(): %s", s->r.err);
+    }
+    UNPROTECT(1);
+    return res_;
+  }
+  
+  if (s->compressed) {
+    if (zblock_reader_init(&s->z, s->r.nthreads, plain_read, s) < 0) {
+      Rf_error("decrypt_unserialize_(): %s", unserialize_err(s));
+    }
+    if (s->r.info.codec != 0 && s->z.codec != s->r.info.codec) {
+      Rf_error("decrypt_unserialize_(): compression codec doesn't match the header");
+    }
+  }
+  
+  struct R_inpstream_st stream;
+  R_InitInPStream(&stream, (R_pstream_data_t)s, R_pstream_any_format,
+                  in_char, in_bytes, NULL, R_NilValue);
+  SEXP robj_ = PROTECT(R_Unserialize(&stream));
+  
+  if (s->compressed && zblock_reader_finish(&s->z) < 0) {
+    Rf_error("decrypt_unserialize_(): %s", unserialize_err(s));
+  }
+  if (stream_reader_finish(&s->r) < 0) {
+    Rf_error("decrypt_unserialize_(): %s", s->r.err);
+  }
+  
+  SEXP res_ = PROTECT(Rf_allocVector(VECSXP, 1));
+  SET_VECTOR_ELT(res_, 0, robj_);
+  UNPROTECT(2);
+  return res_;
+}
+
+
+static void unserialize_cleanup(void *data) {
+  unserialize_state *s = (unserialize_state *)data;
+  crypto_wipe(s->peek, sizeof(s->peek));
+  zblock_reader_free(&s->z);
+  stream_reader_free(&s->r);
+  mapfile_close(&s->mf);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Decrypt and unserialize an R object
+//
+// Returns a list holding the object if the plain text was serialized, with
+// or without block compression.  Otherwise returns the plain text as a raw
+// vector for the caller to decompress and unserialize.
+//
+// @param src_ raw vector or filename
+// @param key_ 32 bytes.  Raw vector. Or hex string. Or password to feed to
+//        argon2()
+// @param additional_data_ data used for message authentication, but not
+//        encrypted or included with encrypted output
+// @param threads_ number of threads.  Chunks of streams written in parallel
+//        mode are opened in parallel
+// @param kdf_ Argon2 parameters used if 'key_' is a password. NULL for 
+//        the defaults
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP decrypt_unserialize_(SEXP src_, SEXP key_, SEXP additional_data_, SEXP threads_, SEXP kdf_) {
+  
+  unserialize_state s;
+  memset(&s, 0, sizeof(s));
+  
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Data in the single message format is decrypted in full
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  SEXP dec_ = open_stream_src(src_, key_, additional_data_, threads_, kdf_,
+                              "decrypt_unserialize_()", &s.r, &s.mf);
+  if (dec_ != NULL) {
+    return dec_;
+  }
+  
+  return R_ExecWithCleanup(unserialize_body, &s, unserialize_cleanup, &s);
+}
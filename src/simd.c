@@ -0,0 +1,27 @@
+
+#define R_NO_REMAP
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rdefines.h>
+
+#include "monocypher.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Enable/disable the vectorised code paths in monocypher.
+// Only intended for testing that both paths give identical results.
+//
+// @param enable_ logical. Or NULL to leave the setting unchanged
+// @return logical. TRUE if the AVX2 code paths are in use
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP simd_(SEXP enable_) {
+  if (!Rf_isNull(enable_)) {
+    int enable = Rf_asLogical(enable_);
+    if (enable == NA_LOGICAL) {
+      Rf_error("simd_(): 'enable' must be TRUE or FALSE");
+    }
+    crypto_simd_enabled = enable;
+  }
+  return Rf_ScalarLogical(crypto_simd_avx2());
+}
@@ -0,0 +1,852 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "monocypher.h"
+#include "stream.h"
+#include "parallel.h"
+
+// Not using the R API in this file. All functions return 0 on success or
+// -1 on failure with a message in 'err'.  The caller is responsible for
+// raising any R error after tidying up.
+
+static void store32(uint8_t *p, uint32_t x) {
+  p[0] = (uint8_t)(x      );
+  p[1] = (uint8_t)(x >>  8);
+  p[2] = (uint8_t)(x >> 16);
+  p[3] = (uint8_t)(x >> 24);
+}
+
+static uint32_t load32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Open a file for reading or writing. When reading, 'len' is set to the
+// file size
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int stream_io_open(stream_io *io, const char *filename, const char *mode) {
+  memset(io, 0, sizeof(stream_io));
+
+  if (mode[0] == 'r') {
+#if defined(_WIN32)
+    struct _stati64 st;
+    if (_stati64(filename, &st) != 0) return -1;
+#else
+    struct stat st;
+    if (stat(filename, &st) != 0) return -1;
+#endif
+    io->len = (size_t)st.st_size;
+  }
+
+  io->fp = fopen(filename, mode);
+  return io->fp == NULL ? -1 : 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Get a pointer to 'n' bytes of output space.
+// For memory output this is the destination itself (grown if allowed),
+// otherwise the scratch buffer which must be committed with io_commit()
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static uint8_t *io_reserve(stream_io *io, size_t n, uint8_t *scratch) {
+  if (io->fp != NULL) {
+    return scratch;
+  }
+  if (io->pos + n > io->len) {
+    if (!io->grow) return NULL;
+    size_t len = io->len < 65536 ? 65536 : io->len * 2;
+    if (len < io->pos + n) len = io->pos + n;
+    uint8_t *buf = realloc(io->buf, len);
+    if (buf == NULL) return NULL;
+    io->buf = buf;
+    io->len = len;
+  }
+  return io->buf + io->pos;
+}
+
+static int io_commit(stream_io *io, const uint8_t *p, size_t n) {
+  if (io->fp != NULL) {
+    return fwrite(p, 1, n, io->fp) == n ? 0 : -1;
+  }
+  io->pos += n;
+  return 0;
+}
+
+static int io_write(stream_io *io, const uint8_t *p, size_t n) {
+  uint8_t *dst = io_reserve(io, n, (uint8_t *)p);
+  if (dst == NULL) return -1;
+  if (dst != p) memcpy(dst, p, n);
+  return io_commit(io, dst, n);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Get a pointer to the next 'n' bytes of input.
+// For memory input this points into the source buffer (no copying),
+// otherwise the bytes are read into 'scratch'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static const uint8_t *io_fetch(stream_io *io, size_t n, uint8_t *scratch) {
+  if (io->pos + n > io->len) {
+    return NULL;
+  }
+
+  if (io->fp != NULL) {
+    if (fread(scratch, 1, n, io->fp) != n) {
+      return NULL;
+    }
+    io->pos += n;
+    return scratch;
+  }
+
+  const uint8_t *p = io->buf + io->pos;
+  io->pos += n;
+  return p;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Look at the next 4 bytes of input without consuming them
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int io_peek32(stream_io *io, uint32_t *word) {
+  uint8_t scratch[4];
+  const uint8_t *p = io_fetch(io, 4, scratch);
+  if (p == NULL) return -1;
+  *word = load32(p);
+  io->pos -= 4;
+  if (io->fp != NULL && fseek(io->fp, -4L, SEEK_CUR) != 0) return -1;
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Does this buffer start with a stream header?
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int stream_is_stream(const uint8_t *buf, size_t len) {
+  return len >= STREAM_HEADERSIZE_V1 && memcmp(buf, STREAM_MAGIC, 4) == 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Size of the header starting 'buf', from its version.  0 if unsupported
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t header_size(const uint8_t *buf) {
+  switch (buf[4]) {
+  case 1: return STREAM_HEADERSIZE_V1;
+  case 2: return STREAM_HEADERSIZE;
+  }
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Check a complete header and unpack what it records.
+// Returns NULL on success, otherwise the reason it is invalid.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static const char *parse_header(const uint8_t *header, stream_info *info) {
+  memset(info, 0, sizeof(stream_info));
+
+  info->version = header[4];
+  if (header_size(header) == 0) {
+    return "unsupported stream version";
+  }
+  if (header[5] > STREAM_MODE_PARALLEL || header[7] != 0) {
+    return "unsupported stream mode";
+  }
+  if (header[6] > STREAM_KDF_MAX) {
+    return "unsupported key derivation version";
+  }
+  size_t cs = load32(header + 8);
+  if (cs < STREAM_MINCHUNK || cs > STREAM_MAXCHUNK) {
+    return "invalid chunk size";
+  }
+  info->kdf_version = header[6];
+  if (info->version == 1) {
+    return NULL;
+  }
+
+  info->content       = header[12];
+  info->codec         = header[13];
+  info->kdf_algorithm = header[14];
+  info->kdf_blocks    = load32(header + 16);
+  info->kdf_passes    = load32(header + 20);
+  info->kdf_lanes     = load32(header + 24);
+  if (info->content < STREAM_CONTENT_RAW || info->content > STREAM_CONTENT_SERIALIZED ||
+      info->codec > STREAM_CODEC_MAX || header[15] != 0) {
+    return "unsupported stream content";
+  }
+  // All zero when the key wasn't derived from a password
+  int recorded = info->kdf_algorithm || info->kdf_blocks || info->kdf_passes || info->kdf_lanes;
+  if (recorded && (info->kdf_algorithm > CRYPTO_ARGON2_ID || 
+                   info->kdf_lanes  < 1 || info->kdf_lanes  > STREAM_KDF_MAXLANES  ||
+                   info->kdf_passes < 1 || info->kdf_passes > STREAM_KDF_MAXPASSES ||
+                   info->kdf_blocks < 8 * info->kdf_lanes ||
+                   info->kdf_blocks > STREAM_KDF_MAXBLOCKS)) {
+    return "invalid key derivation parameters";
+  }
+  return NULL;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// What the header at the start of 'buf' records.  Needed before the key
+// can be derived from a password, so before stream_reader_init()
+//
+// Returns NULL on success, otherwise the reason the header is invalid
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+const char *stream_header_info(const uint8_t *buf, size_t len, stream_info *info) {
+  memset(info, 0, sizeof(stream_info));
+  if (!stream_is_stream(buf, len)) return "not an encrypted stream";
+  size_t hs = header_size(buf);
+  if (hs == 0) return "unsupported stream version";
+  if (len < hs) return "stream is truncated";
+  return parse_header(buf, info);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Total size of the encrypted stream for a payload of the given size.
+// There is always at least one frame, even for an empty payload.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t stream_encrypted_size(size_t payload_size, size_t chunk_size) {
+  size_t nframes = payload_size == 0 ? 1 : (payload_size - 1) / chunk_size + 1;
+  return STREAM_PREAMBLE + nframes * STREAM_FRAMESIZE + payload_size;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Additional data for the first frame is [len] [header] [user ad] so that
+// the header and the user's additional data are both authenticated.
+// All other frames only authenticate their own [len].
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static uint8_t *first_frame_ad(const uint8_t *header, size_t header_size,
+                               const uint8_t *ad, size_t ad_size) {
+  uint8_t *buf = malloc(STREAM_LENSIZE + header_size + ad_size);
+  if (buf == NULL) return NULL;
+  memcpy(buf + STREAM_LENSIZE, header, header_size);
+  if (ad_size > 0) {
+    memcpy(buf + STREAM_LENSIZE + header_size, ad, ad_size);
+  }
+  return buf;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Context for sealing/opening a single frame in parallel mode.
+// The frame index is mixed into the nonce so every frame has a unique
+// nonce under the stream key.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void frame_ctx(crypto_aead_ctx *ctx, const crypto_aead_ctx *stream_ctx, uint64_t idx) {
+  uint8_t nonce[8];
+  for (int i = 0; i < 8; i++) {
+    nonce[i] = stream_ctx->nonce[i] ^ (uint8_t)(idx >> (8 * i));
+  }
+  crypto_aead_init_djb(ctx, stream_ctx->key, nonce);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A batch of consecutive frames.
+// All frames hold 'chunk_size' bytes, except the last which holds 'last_len'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  const crypto_aead_ctx *ctx;
+  const uint8_t *ad;     // additional data for the first frame in the stream
+  size_t         ad_size;
+  const uint8_t *src;
+  uint8_t       *dst;
+  size_t         chunk_size;
+  size_t         nframes;
+  size_t         last_len;
+  uint64_t       first_idx;
+  int           *status;
+} stream_batch;
+
+static size_t batch_len(const stream_batch *b, size_t j) {
+  return j + 1 == b->nframes ? b->last_len : b->chunk_size;
+}
+
+static void frame_ad(const stream_batch *b, size_t j, const uint8_t *frame,
+                     const uint8_t **ad, size_t *ad_size) {
+  if (b->first_idx + j == 0) {
+    *ad      = b->ad;
+    *ad_size = b->ad_size;
+  } else {
+    *ad      = frame;
+    *ad_size = STREAM_LENSIZE;
+  }
+}
+
+static void seal_job(void *arg, size_t j) {
+  const stream_batch *b = (const stream_batch *)arg;
+  const uint8_t *in  = b->src + j * b->chunk_size;
+  uint8_t       *out = b->dst + j * (b->chunk_size + STREAM_FRAMESIZE);
+
+  const uint8_t *ad;
+  size_t ad_size;
+  frame_ad(b, j, out, &ad, &ad_size);
+
+  crypto_aead_ctx ctx;
+  frame_ctx(&ctx, b->ctx, b->first_idx + j);
+  crypto_aead_write(&ctx, out + STREAM_FRAMESIZE, out + STREAM_LENSIZE,
+                    ad, ad_size, in, batch_len(b, j));
+  crypto_wipe(&ctx, sizeof(ctx));
+}
+
+static void open_job(void *arg, size_t j) {
+  const stream_batch *b = (const stream_batch *)arg;
+  const uint8_t *in  = b->src + j * (b->chunk_size + STREAM_FRAMESIZE);
+  uint8_t       *out = b->dst + j * b->chunk_size;
+
+  const uint8_t *ad;
+  size_t ad_size;
+  frame_ad(b, j, in, &ad, &ad_size);
+
+  crypto_aead_ctx ctx;
+  frame_ctx(&ctx, b->ctx, b->first_idx + j);
+  b->status[j] = crypto_aead_read(&ctx, out, in + STREAM_LENSIZE,
+                                  ad, ad_size, in + STREAM_FRAMESIZE, batch_len(b, j));
+  crypto_wipe(&ctx, sizeof(ctx));
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Initialise a writer.  The caller must already have setup 'w->io' and
+// should wipe the key once this returns.
+//
+// @param key 32-byte key
+// @param nonce 24 random bytes
+// @param ad,ad_size user additional data. May be NULL
+// @param chunk_size number of bytes of plain text in each frame
+// @param nthreads number of threads. If more than 1, the stream is written
+//        in parallel mode and 'nthreads' frames are sealed at a time.
+// @param info content, codec and key derivation parameters to record in
+//        the header.  'version' is ignored
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int stream_writer_init(stream_writer *w, const uint8_t key[32], const uint8_t nonce[24],
+                       const uint8_t *ad, size_t ad_size, size_t chunk_size,
+                       int nthreads, const stream_info *info) {
+
+  w->ad         = NULL;
+  w->chunk      = NULL;
+  w->frame      = NULL;
+  w->chunk_size = chunk_size;
+  w->chunk_idx  = 0;
+  w->frame_idx  = 0;
+  w->nthreads   = nthreads < 1 ? 1 : nthreads;
+  w->mode       = w->nthreads > 1 ? STREAM_MODE_PARALLEL : STREAM_MODE_RATCHET;
+  w->nbatch     = (size_t)w->nthreads;
+  w->err        = NULL;
+
+  if (chunk_size < STREAM_MINCHUNK || chunk_size > STREAM_MAXCHUNK) {
+    w->err = "invalid chunk size";
+    return -1;
+  }
+
+  memcpy(w->header, STREAM_MAGIC, 4);
+  w->header[4] = STREAM_VERSION;
+  w->header[5] = (uint8_t)w->mode;
+  w->header[6] = (uint8_t)info->kdf_version;
+  w->header[7] = 0;
+  store32(w->header + 8, (uint32_t)chunk_size);
+  w->header[12] = (uint8_t)info->content;
+  w->header[13] = (uint8_t)info->codec;
+  w->header[14] = (uint8_t)info->kdf_algorithm;
+  w->header[15] = 0;
+  store32(w->header + 16, info->kdf_blocks);
+  store32(w->header + 20, info->kdf_passes);
+  store32(w->header + 24, info->kdf_lanes);
+
+  stream_info check;
+  const char *err = parse_header(w->header, &check);
+  if (err != NULL) {
+    w->err = err;
+    return -1;
+  }
+
+  w->ad      = first_frame_ad(w->header, STREAM_HEADERSIZE, ad, ad_size);
+  w->ad_size = STREAM_LENSIZE + STREAM_HEADERSIZE + ad_size;
+  w->chunk   = malloc(w->nbatch * chunk_size);
+  if (w->io.fp != NULL) {
+    w->frame = malloc(w->nbatch * (chunk_size + STREAM_FRAMESIZE));
+  }
+  if (w->ad == NULL || w->chunk == NULL || (w->io.fp != NULL && w->frame == NULL)) {
+    w->err = "couldn't allocate stream buffers";
+    return -1;
+  }
+
+  if (io_write(&w->io, w->header, STREAM_HEADERSIZE) < 0 ||
+      io_write(&w->io, nonce, STREAM_NONCESIZE) < 0) {
+    w->err = "couldn't write stream header";
+    return -1;
+  }
+
+  crypto_aead_init_x(&w->ctx, key, nonce);
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Encrypt and write 'size' bytes of plain text as consecutive frames.
+// Unless this is the final batch, 'size' is a multiple of the chunk size.
+//
+// In ratchet mode the key ratchets forward after every frame, so frames
+// are sealed in order and can't be reordered.
+// In parallel mode every frame is sealed independently.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static int seal_frames(stream_writer *w, const uint8_t *data, size_t size, int final) {
+
+  size_t cs      = w->chunk_size;
+  size_t nframes = size == 0 ? 1 : (size - 1) / cs + 1;
+  size_t n       = nframes * STREAM_FRAMESIZE + size;
+
+  uint8_t *out = io_reserve(&w->io, n, w->frame);
+  if (out == NULL) {
+    w->err = "output buffer too small";
+    return -1;
+  }
+
+  stream_batch b = {
+    .ctx        = &w->ctx,
+    .ad         = w->ad,
+    .ad_size    = w->ad_size,
+    .src        = data,
+    .dst        = out,
+    .chunk_size = cs,
+    .nframes    = nframes,
+    .last_len   = size - (nframes - 1) * cs,
+    .first_idx  = w->frame_idx
+  };
+
+  for (size_t j = 0; j < nframes; j++) {
+    uint32_t word = (uint32_t)batch_len(&b, j);
+    if (final && j + 1 == nframes) {
+      word |= STREAM_FINAL;
+    }
+    store32(out + j * (cs + STREAM_FRAMESIZE), word);
+    if (w->frame_idx + j == 0) {
+      store32(w->ad, word);
+    }
+  }
+
+  if (w->mode == STREAM_MODE_PARALLEL) {
+    parallel_for(nframes, w->nthreads, seal_job, &b);
+  } else {
+    for (size_t j = 0; j < nframes; j++) {
+      uint8_t *frame = out + j * (cs + STREAM_FRAMESIZE);
+      const uint8_t *ad;
+      size_t ad_size;
+      frame_ad(&b, j, frame, &ad, &ad_size);
+      crypto_aead_write(&w->ctx, frame + STREAM_FRAMESIZE, frame + STREAM_LENSIZE,
+                        ad, ad_size, data + j * cs, batch_len(&b, j));
+    }
+  }
+
+  if (io_commit(&w->io, out, n) < 0) {
+    w->err = "couldn't write frame";
+    return -1;
+  }
+
+  w->frame_idx += nframes;
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Add plain text to the stream.
+// A full batch is only sealed once more data arrives, as the final frame
+// must be flagged as such.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int stream_writer_update(stream_writer *w, const uint8_t *data, size_t n) {
+
+  size_t batch = w->nbatch * w->chunk_size;
+
+  while (n > 0) {
+    if (w->chunk_idx == batch) {
+      if (seal_frames(w, w->chunk, batch, 0) < 0) return -1;
+      w->chunk_idx = 0;
+    }
+
+    // Seal directly from the caller's buffer when there is no buffered data
+    if (w->chunk_idx == 0 && n > batch) {
+      if (seal_frames(w, data, batch, 0) < 0) return -1;
+      data += batch;
+      n    -= batch;
+      continue;
+    }
+
+    size_t m = batch - w->chunk_idx;
+    if (m > n) m = n;
+    memcpy(w->chunk + w->chunk_idx, data, m);
+    w->chunk_idx += m;
+    data         += m;
+    n            -= m;
+  }
+
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Seal the remaining data. The final frame may be empty.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int stream_writer_final(stream_writer *w) {
+  if (seal_frames(w, w->chunk, w->chunk_idx, 1) < 0) return -1;
+  w->chunk_idx = 0;
+
+  if (w->io.fp != NULL && fflush(w->io.fp) != 0) {
+    w->err = "couldn't write to file";
+    return -1;
+  }
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Wipe and free the writer. Closes any file.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int stream_writer_free(stream_writer *w) {
+  int status = 0;
+  if (w->chunk != NULL) {
+    crypto_wipe(w->chunk, w->nbatch * w->chunk_size);
+    free(w->chunk);
+  }
+  if (w->frame != NULL) {
+    crypto_wipe(w->frame, w->nbatch * (w->chunk_size + STREAM_FRAMESIZE));
+    free(w->frame);
+  }
+  free(w->ad);
+  w->chunk = NULL;
+  w->frame = NULL;
+  w->ad    = NULL;
+  crypto_wipe(&w->ctx, sizeof(w->ctx));
+
+  if (w->io.fp != NULL) {
+    status = fclose(w->io.fp) == 0 ? 0 : -1;
+    w->io.fp = NULL;
+  }
+  return status;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Initialise a reader. The caller must already have setup 'r->io'.
+// Parses the header and works out the frame layout from the total size of
+// the input. No memory is allocated until the first read.
+//
+// @param key 32-byte key
+// @param ad,ad_size user additional data. May be NULL.  Must remain valid
+//        until the first frame has been read.
+// @param nthreads number of threads for opening frames of a stream in
+//        parallel mode
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int stream_reader_init(stream_reader *r, const uint8_t key[32],
+                       const uint8_t *ad, size_t ad_size, int nthreads) {
+
+  r->user_ad      = ad;
+  r->user_ad_size = ad_size;
+  r->ad           = NULL;
+  r->chunk        = NULL;
+  r->frame        = NULL;
+  r->status       = NULL;
+  r->chunk_len    = 0;
+  r->chunk_pos    = 0;
+  r->frame_idx    = 0;
+  r->nthreads     = nthreads < 1 ? 1 : nthreads;
+  r->err          = NULL;
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // The version 1 part of the header gives the size of the rest of it
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  uint8_t scratch[STREAM_PREAMBLE];
+  const uint8_t *p = io_fetch(&r->io, STREAM_HEADERSIZE_V1, scratch);
+  if (p == NULL || !stream_is_stream(p, STREAM_HEADERSIZE_V1)) {
+    r->err = "not an encrypted stream";
+    return -1;
+  }
+  memcpy(r->header, p, STREAM_HEADERSIZE_V1);
+
+  r->header_size = header_size(r->header);
+  if (r->header_size == 0) {
+    r->err = "unsupported stream version";
+    return -1;
+  }
+  size_t rest = r->header_size - STREAM_HEADERSIZE_V1;
+  if (rest > 0) {
+    p = io_fetch(&r->io, rest, scratch);
+    if (p == NULL) {
+      r->err = "stream is truncated";
+      return -1;
+    }
+    memcpy(r->header + STREAM_HEADERSIZE_V1, p, rest);
+  }
+
+  const char *err = parse_header(r->header, &r->info);
+  if (err != NULL) {
+    r->err = err;
+    return -1;
+  }
+  r->mode       = r->header[5];
+  r->nbatch     = r->mode == STREAM_MODE_PARALLEL ? (size_t)r->nthreads : 1;
+  r->chunk_size = load32(r->header + 8);
+  size_t cs     = r->chunk_size;
+
+  const uint8_t *nonce = io_fetch(&r->io, STREAM_NONCESIZE, scratch);
+  if (nonce == NULL) {
+    r->err = "stream is truncated";
+    return -1;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Every frame except the last holds exactly 'cs' bytes, and the last
+  // frame holds between 0 and 'cs' bytes.  So the frame layout is fully
+  // determined by the size of the input. The 'len' of each frame is still
+  // checked as it is read.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  size_t payload = r->io.len - r->header_size - STREAM_NONCESIZE;
+  if (payload < STREAM_FRAMESIZE) {
+    r->err = "stream is truncated";
+    return -1;
+  }
+  size_t full    = cs + STREAM_FRAMESIZE;
+  r->nframes     = (payload + full - 1) / full;
+  size_t rem     = payload - (size_t)(r->nframes - 1) * full;
+  if (rem < STREAM_FRAMESIZE) {
+    r->err = "stream is truncated";
+    return -1;
+  }
+  r->last_len    = rem - STREAM_FRAMESIZE;
+  r->total       = (r->nframes - 1) * cs + r->last_len;
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // The first frame's 'len' must match the layout.  Checked here so that
+  // data which only happens to start with the magic (e.g. a single message
+  // whose nonce does) fails now, rather than part way through reading.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  uint32_t word;
+  uint32_t expected = r->nframes == 1 ? (uint32_t)r->last_len | STREAM_FINAL : (uint32_t)cs;
+  if (io_peek32(&r->io, &word) < 0) {
+    r->err = "couldn't read frame";
+    return -1;
+  }
+  if (word != expected) {
+    r->err = r->nframes == 1 && (word & STREAM_FINAL) == 0 ? "stream is truncated" : "corrupt frame header";
+    return -1;
+  }
+
+  crypto_aead_init_x(&r->ctx, key, nonce);
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read, authenticate and decrypt the next 'nframes' frames into 'dst'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t next_frame_len(stream_reader *r, size_t j) {
+  return r->frame_idx + j + 1 == r->nframes ? r->last_len : r->chunk_size;
+}
+
+static int open_frames(stream_reader *r, uint8_t *dst, size_t nframes) {
+
+  size_t cs = r->chunk_size;
+
+  if (r->frame_idx + nframes > r->nframes) {
+    r->err = "read past end of stream";
+    return -1;
+  }
+
+  if (r->status == NULL) {
+    r->status = calloc(r->nbatch, sizeof(int));
+    if (r->io.fp != NULL) {
+      r->frame = malloc(r->nbatch * (cs + STREAM_FRAMESIZE));
+    }
+    if (r->status == NULL || (r->io.fp != NULL && r->frame == NULL)) {
+      r->err = "couldn't allocate stream buffers";
+      return -1;
+    }
+  }
+
+  size_t last_len = next_frame_len(r, nframes - 1);
+  size_t n = nframes * STREAM_FRAMESIZE + (nframes - 1) * cs + last_len;
+  const uint8_t *in = io_fetch(&r->io, n, r->frame);
+  if (in == NULL) {
+    r->err = "couldn't read frame";
+    return -1;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Check the frame headers
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  for (size_t j = 0; j < nframes; j++) {
+    int      final = r->frame_idx + j + 1 == r->nframes;
+    uint32_t word  = load32(in + j * (cs + STREAM_FRAMESIZE));
+    if (word != ((uint32_t)next_frame_len(r, j) | (final ? STREAM_FINAL : 0))) {
+      r->err = final && (word & STREAM_FINAL) == 0 ? "stream is truncated" : "corrupt frame header";
+      return -1;
+    }
+    if (r->frame_idx + j == 0) {
+      r->ad = first_frame_ad(r->header, r->header_size, r->user_ad, r->user_ad_size);
+      if (r->ad == NULL) {
+        r->err = "couldn't allocate stream buffers";
+        return -1;
+      }
+      r->ad_size = STREAM_LENSIZE + r->header_size + r->user_ad_size;
+      store32(r->ad, word);
+    }
+  }
+
+  stream_batch b = {
+    .ctx        = &r->ctx,
+    .ad         = r->ad,
+    .ad_size    = r->ad_size,
+    .src        = in,
+    .dst        = dst,
+    .chunk_size = cs,
+    .nframes    = nframes,
+    .last_len   = last_len,
+    .first_idx  = r->frame_idx,
+    .status     = r->status
+  };
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Decrypt
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  int mismatch = 0;
+  if (r->mode == STREAM_MODE_PARALLEL) {
+    parallel_for(nframes, r->nthreads, open_job, &b);
+    for (size_t j = 0; j < nframes; j++) {
+      mismatch |= r->status[j];
+    }
+  } else {
+    for (size_t j = 0; j < nframes && !mismatch; j++) {
+      const uint8_t *frame = in + j * (cs + STREAM_FRAMESIZE);
+      const uint8_t *ad;
+      size_t ad_size;
+      frame_ad(&b, j, frame, &ad, &ad_size);
+      mismatch = crypto_aead_read(&r->ctx, dst + j * cs, frame + STREAM_LENSIZE,
+                                  ad, ad_size, frame + STREAM_FRAMESIZE, batch_len(&b, j));
+    }
+  }
+
+  if (mismatch) {
+    r->err = "decryption failed";
+    return -1;
+  }
+
+  r->frame_idx += nframes;
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Read 'n' bytes of plain text into 'dst'.
+// Whole frames are decrypted directly into 'dst' (up to 'nbatch' at a
+// time). Partial frames are decrypted into an internal buffer first, along
+// with the frames following them in the same batch, so that many small reads
+// still open frames in parallel.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int stream_reader_read(stream_reader *r, uint8_t *dst, size_t n) {
+
+  while (n > 0) {
+    if (r->chunk_pos < r->chunk_len) {
+      size_t m = r->chunk_len - r->chunk_pos;
+      if (m > n) m = n;
+      memcpy(dst, r->chunk + r->chunk_pos, m);
+      r->chunk_pos += m;
+      dst          += m;
+      n            -= m;
+      continue;
+    }
+
+    if (r->frame_idx >= r->nframes) {
+      r->err = "read past end of stream";
+      return -1;
+    }
+
+    // How many whole frames fit in the remaining output?
+    size_t nframes = 0;
+    size_t len     = 0;
+    while (nframes < r->nbatch && r->frame_idx + nframes < r->nframes &&
+           len + next_frame_len(r, nframes) <= n) {
+      len += next_frame_len(r, nframes);
+      nframes++;
+    }
+
+    if (nframes > 0) {
+      if (open_frames(r, dst, nframes) < 0) return -1;
+      dst += len;
+      n   -= len;
+    } else {
+      if (r->chunk == NULL) {
+        r->chunk = malloc(r->nbatch * r->chunk_size);
+        if (r->chunk == NULL) {
+          r->err = "couldn't allocate stream buffers";
+          return -1;
+        }
+      }
+      r->chunk_len = 0;
+      r->chunk_pos = 0;
+      while (nframes < r->nbatch && r->frame_idx + nframes < r->nframes) {
+        r->chunk_len += next_frame_len(r, nframes);
+        nframes++;
+      }
+      if (open_frames(r, r->chunk, nframes) < 0) {
+        r->chunk_len = 0;
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Check that all plain text has been consumed and that the final frame has
+// been authenticated. An empty final frame may still need to be read.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int stream_reader_finish(stream_reader *r) {
+  if (r->frame_idx + 1 == r->nframes && r->last_len == 0) {
+    uint8_t empty[1];
+    if (open_frames(r, empty, 1) < 0) return -1;
+  }
+
+  if (r->frame_idx != r->nframes || r->chunk_pos != r->chunk_len) {
+    r->err = "unread data at end of stream";
+    return -1;
+  }
+  return 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Wipe and free the reader. Closes any file.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void stream_reader_free(stream_reader *r) {
+  if (r->chunk != NULL) {
+    crypto_wipe(r->chunk, r->nbatch * r->chunk_size);
+    free(r->chunk);
+  }
+  if (r->frame != NULL) {
+    crypto_wipe(r->frame, r->nbatch * (r->chunk_size + STREAM_FRAMESIZE));
+    free(r->frame);
+  }
+  free(r->status);
+  free(r->ad);
+  r->chunk  = NULL;
+  r->frame  = NULL;
+  r->status = NULL;
+  r->ad     = NULL;
+  crypto_wipe(&r->ctx, sizeof(r->ctx));
+
+  if (r->io.fp != NULL) {
+    fclose(r->io.fp);
+    r->io.fp = NULL;
+  }
+}
@@ -0,0 +1,160 @@
+#ifndef RMONOCYPHER_STREAM_H
+#define RMONOCYPHER_STREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "monocypher.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Chunked stream format
+//
+// [header] [nonce] [len, mac, data] [len, mac, data] ...
+//
+// header = [magic 4] [version 1] [mode 1] [kdf 1] [reserved 1] [chunk_size 4]
+//          [content 1] [codec 1] [kdf_algorithm 1] [reserved 1]
+//          [kdf_blocks 4] [kdf_passes 4] [kdf_lanes 4]
+// 'len'  = 4-byte little-endian size of 'data'. The high bit is set on the
+//          final frame.  Every frame except the final one holds exactly
+//          'chunk_size' bytes of data.
+//
+// Modes
+//   ratchet  - the key ratchets forward after each frame. Frames must be
+//              processed in order.
+//   parallel - each frame is sealed with its own nonce derived from the
+//              frame index, so frames can be processed independently.
+//
+// 'kdf' is the key derivation version (see argon2.h) to use if the key is 
+// a password.  Streams written before this byte was used have 0 (legacy).
+// In version 2 headers it is 0 if the key wasn't derived from a password,
+// like the kdf_* fields.
+//
+// Version 1 headers end after 'chunk_size'.  Version 2 adds:
+//   content - what the plain text is. See STREAM_CONTENT_*
+//   codec   - block compression codec of the plain text (see compress.h).
+//             0 for none
+//   kdf_*   - Argon2 parameters (see argon2.h) to use if the key is a
+//             password.  All 0 if the key wasn't derived from a password
+// So data can be decrypted and decoded without being told how it was
+// written, or trying to guess.  All numbers are little-endian.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define STREAM_MAGIC       "\x89RMC"
+#define STREAM_VERSION     2
+#define STREAM_HEADERSIZE_V1 12
+#define STREAM_HEADERSIZE  28
+#define STREAM_NONCESIZE   24
+#define STREAM_LENSIZE      4
+#define STREAM_MACSIZE     16
+#define STREAM_FRAMESIZE   (STREAM_LENSIZE + STREAM_MACSIZE)
+#define STREAM_PREAMBLE    (STREAM_HEADERSIZE + STREAM_NONCESIZE)
+#define STREAM_FINAL       0x80000000u
+
+#define STREAM_CHUNKSIZE   (1024 * 1024)
+#define STREAM_MINCHUNK    64
+#define STREAM_MAXCHUNK    (256 * 1024 * 1024)
+
+#define STREAM_MODE_RATCHET  0
+#define STREAM_MODE_PARALLEL 1
+
+#define STREAM_KDF_MAX 1
+
+// Upper limits on recorded Argon2 parameters.  The header is only
+// authenticated after the key has been derived with them
+#define STREAM_KDF_MAXBLOCKS (4 * 1024 * 1024)  // 4 GB
+#define STREAM_KDF_MAXPASSES 256
+#define STREAM_KDF_MAXLANES  256
+#define STREAM_CODEC_MAX 3
+
+#define STREAM_CONTENT_UNKNOWN    0  // version 1 header. Not recorded
+#define STREAM_CONTENT_RAW        1  // bytes
+#define STREAM_CONTENT_SERIALIZED 2  // output of serialize()
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// What a stream header records about the plain text and the key.
+// 'kdf_blocks' is 0 if the Argon2 parameters were not recorded.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  int      version;
+  int      content;
+  int      codec;
+  int      kdf_version;
+  uint32_t kdf_algorithm;
+  uint32_t kdf_blocks;
+  uint32_t kdf_passes;
+  uint32_t kdf_lanes;
+} stream_info;
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Source/sink for a stream. Either a memory buffer or a file
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef struct {
+  FILE    *fp;   // file. Or NULL if using memory buffer
+  uint8_t *buf;  // memory buffer
+  size_t   len;  // buffer capacity (or file size when reading)
+  size_t   pos;  // current position in buffer
+  int      grow; // when writing: 'buf' is from malloc() and grows as needed.
+                 // The caller frees it
+} stream_io;
+
+typedef struct {
+  stream_io io;
+  crypto_aead_ctx ctx;
+  int      mode;
+  int      nthreads;
+  uint8_t  header[STREAM_HEADERSIZE];
+  uint8_t *ad;          // additional data for first frame: [len] [header] [user ad]
+  size_t   ad_size;
+  uint8_t *chunk;       // plain text waiting to be sealed. 'nbatch' chunks
+  size_t   chunk_size;
+  size_t   chunk_idx;
+  size_t   nbatch;      // number of frames sealed together
+  uint8_t *frame;       // scratch frames when writing to file
+  uint64_t frame_idx;
+  const char *err;
+} stream_writer;
+
+typedef struct {
+  stream_io io;
+  crypto_aead_ctx ctx;
+  int      mode;
+  int      nthreads;
+  uint8_t  header[STREAM_HEADERSIZE];
+  size_t   header_size;
+  stream_info info;
+  const uint8_t *user_ad;
+  size_t   user_ad_size;
+  uint8_t *ad;          // additional data for first frame: [len] [header] [user ad]
+  size_t   ad_size;
+  size_t   chunk_size;
+  uint64_t nframes;
+  uint64_t frame_idx;
+  size_t   last_len;    // size of data in final frame
+  uint64_t total;       // total bytes of plain text in stream
+  uint8_t *chunk;       // decrypted frames for partial reads. Up to 'nbatch' frames
+  size_t   chunk_len;
+  size_t   chunk_pos;
+  size_t   nbatch;      // maximum number of frames opened together
+  uint8_t *frame;       // scratch frames when reading from file
+  int     *status;      // status of each frame in a batch
+  const char *err;
+} stream_reader;
+
+int    stream_io_open(stream_io *io, const char *filename, const char *mode);
+int    stream_is_stream(const uint8_t *buf, size_t len);
+const char *stream_header_info(const uint8_t *buf, size_t len, stream_info *info);
+size_t stream_encrypted_size(size_t payload_size, size_t chunk_size);
+
+int  stream_writer_init(stream_writer *w, const uint8_t key[32], const uint8_t nonce[24],
+                        const uint8_t *ad, size_t ad_size, size_t chunk_size,
+                        int nthreads, const stream_info *info);
+int  stream_writer_update(stream_writer *w, const uint8_t *data, size_t n);
+int  stream_writer_final(stream_writer *w);
+int  stream_writer_free(stream_writer *w);
+
+int  stream_reader_init(stream_reader *r, const uint8_t key[32],
+                        const uint8_t *ad, size_t ad_size, int nthreads);
+int  stream_reader_read(stream_reader *r, uint8_t *dst, size_t n);
+int  stream_reader_finish(stream_reader *r);
+void stream_reader_free(stream_reader *r);
+
+#endif
@@ -3,15 +3,27 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
 
 #include <R.h>
 #include <Rinternals.h>
 #include <Rdefines.h>
 
+#include "monocypher.h"
 #include "utils.h"
 #include "argon2.h"
+#include "keycache.h"
+#include "derive-key.h"
+#include "rbyte.h"
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Write raw bytes to screen
@@ -91,10 +103,15 @@ char *bytes_to_hex(uint8_t *buf, size_t len) {
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Unpack a user-supplied salt
+//
+// Text which isn't a 32-character hex string is expanded to a 16-byte
+// salt. How this is done depends on the key derivation version 
+// (see argon2.h)
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void unpack_salt(SEXP salt_, uint8_t salt[16]) {
+void unpack_salt(SEXP salt_, const argon_params *params, uint8_t salt[16]) {
   
   static uint8_t default_salt[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+  static const char *salt_domain = "rmonocypher kdf v1 salt";
   
   if (TYPEOF(salt_) == RAWSXP) {
     if (Rf_length(salt_) >= 16) {
@@ -108,18 +125,75 @@ void unpack_salt(SEXP salt_, uint8_t salt[16]) {
       // Success! Parsed hexstring to 16 bytes
     } else if (strlen(text) > 0) {
       // Derive 16-byte salt from this text
-      argon_internal((uint8_t *)text, (size_t)strlen(text), default_salt, salt, 16);
+      if (params->version == ARGON2_KDF_LEGACY) {
+        argon_internal((uint8_t *)text, (size_t)strlen(text), default_salt, salt, 16, params);
+      } else {
+        crypto_blake2b_keyed(salt, 16, 
+                             (const uint8_t *)salt_domain, strlen(salt_domain), 
+                             (const uint8_t *)text, strlen(text));
+      }
     } else {
       Rf_error("argon2_(): if 'salt' is a string it must not be empty");
     }
+  } else {
+    Rf_error("argon2_(): 'salt' must be a raw vector or string");
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Derive a key from a password, using the key cache if it is enabled
+//
+// @param password_ non-empty string
+// @param salt_ salt as accepted by unpack_salt().  Or NULL to derive the 
+//        salt from the password itself
+// @param params Argon2 parameters and key derivation version
+// @param key output
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void password_to_key(SEXP password_, SEXP salt_, const argon_params *params, uint8_t key[32]) {
+  
+  const char *password = CHAR(STRING_ELT(password_, 0));
+  size_t pass_size = strlen(password);
+  
+  // Only a legacy salt derived from the password is expensive. Other salts
+  // are unpacked first so they can be part of the cache id
+  int slow_salt = Rf_isNull(salt_) && params->version == ARGON2_KDF_LEGACY;
+  SEXP src_ = Rf_isNull(salt_) ? password_ : salt_;
+  
+  uint8_t salt[16];
+  if (!slow_salt) {
+    unpack_salt(src_, params, salt);
+  }
+  
+  uint8_t id[32];
+  if (keycache_enabled()) {
+    keycache_id(id, (const uint8_t *)password, pass_size, 
+                slow_salt ? NULL : salt, slow_salt ? 0 : sizeof(salt), params);
+    if (keycache_get(id, key)) {
+      crypto_wipe(id, sizeof(id));
+      return;
+    }
+  }
+  
+  if (slow_salt) {
+    unpack_salt(src_, params, salt);
+  }
+  argon_internal((uint8_t *)password, pass_size, salt, key, 32, params);
+  
+  if (keycache_enabled()) {
+    keycache_put(id, key);
+    crypto_wipe(id, sizeof(id));
   }
 }
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Unpack a user-supplied key
+//
+// 'params' sets the Argon2 costs and key derivation version used when the 
+// key is a password. If NULL, the default parameters are used.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void unpack_key(SEXP key_, uint8_t key[32]) {
+void unpack_key(SEXP key_, const argon_params *params, uint8_t key[32]) {
 
   if (Rf_isNull(key_)) {
     Rf_error("unpack_key(): Key must not be NULL");
@@ -139,18 +213,38 @@ void unpack_key(SEXP key_, uint8_t key[32]) {
       //    Use random salt
       //    Use password as salt
       //    Use constant value as salt.
-      uint8_t salt[16];
-      unpack_salt(key_, salt);
-      argon_internal((uint8_t *)str, len, salt, key, 32);
+      argon_params defaults;
+      if (params == NULL) {
+        argon_default_params(&defaults);
+        params = &defaults;
+      }
+      password_to_key(key_, R_NilValue, params, key);
     } else {
       Rf_error("unpack_key(): zero-length string not allowed here");
     }
+  } else if (is_key_handle(key_)) {
+    unpack_key_handle(key_, key);
   } else {
     Rf_error("unpack_key(): Type of 'key' not understood");
   }
 }
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Will unpack_key() derive the key from a password?
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int key_is_password(SEXP key_) {
+  if (TYPEOF(key_) != STRSXP || Rf_length(key_) == 0) {
+    return 0;
+  }
+  const char *str = CHAR(STRING_ELT(key_, 0));
+  uint8_t key[32];
+  int is_hex = hexstring_to_bytes(str, key, 32);
+  crypto_wipe(key, sizeof(key));
+  return !is_hex && strlen(str) > 0;
+}
+
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -197,3 +291,96 @@ SEXP wrap_bytes_for_return(uint8_t *buf, size_t N, SEXP type_) {
 
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Unpack user-supplied additional data.
+// 'ad' points into the R object, so no copy is made.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void unpack_additional_data(SEXP additional_data_, uint8_t **ad, size_t *ad_len) {
+  
+  *ad = NULL;
+  *ad_len = 0;
+  
+  if (Rf_isNull(additional_data_)) {
+    // Do nothing
+  } else if (TYPEOF(additional_data_) == RAWSXP) {
+    if (Rf_length(additional_data_) > 0) {
+      *ad = RAW(additional_data_);
+      *ad_len = (size_t)Rf_xlength(additional_data_); 
+    } else {
+      Rf_error("'additional_data' cannot be empty raw vector");
+    }
+  } else if (TYPEOF(additional_data_) == STRSXP) {
+    const char *ad_string = CHAR(STRING_ELT(additional_data_, 0));
+    if (strlen(ad_string) > 0) {
+      *ad = (uint8_t *)ad_string;
+      *ad_len = strlen(ad_string);
+    } else {
+      Rf_error("'additional_data' cannot be empty string");
+    }
+  } else {
+    Rf_error("'additional_data' must be raw vector or string.");
+  }
+}
+
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Unpack the number of threads. Must be a single positive number
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int unpack_threads(SEXP threads_) {
+  if ((TYPEOF(threads_) != INTSXP && TYPEOF(threads_) != REALSXP) || Rf_length(threads_) != 1) {
+    Rf_error("'threads' must be a single number");
+  }
+  int threads = Rf_asInteger(threads_);
+  if (threads == NA_INTEGER || threads < 1) {
+    Rf_error("'threads' must be a positive number");
+  }
+  return threads;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Name for a temporary file in the same directory as 'filename', so that
+// output can be written there and renamed into place by replace_file() 
+// once it is complete.  Allocated with R_alloc()
+//
+// Returns NULL if 'filename' exists but is not a regular file (e.g. a
+// device or a pipe), which must be written to directly
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+const char *temp_filename(const char *filename) {
+  struct stat st;
+  if (stat(filename, &st) == 0 && !S_ISREG(st.st_mode)) {
+    return NULL;
+  }
+  
+  uint8_t tag[8];
+  rbyte(tag, sizeof(tag));
+  char *hex = bytes_to_hex(tag, sizeof(tag));
+  
+  size_t len = strlen(filename) + 1 + 2 * sizeof(tag) + 4 + 1;
+  char *tmpname = R_alloc(len, 1);
+  snprintf(tmpname, len, "%s.%s.tmp", filename, hex);
+  free(hex);
+  return tmpname;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Move a completed temporary file over 'filename'.  On failure the 
+// temporary file is removed
+//
+// @return 0 on success, -1 on failure
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+int replace_file(const char *tmpname, const char *filename) {
+#if defined(_WIN32)
+  int ok = MoveFileExA(tmpname, filename, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  int ok = rename(tmpname, filename) == 0;
+#endif
+  if (!ok) {
+    remove(tmpname);
+    return -1;
+  }
+  return 0;
+}
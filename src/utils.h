@@ -1,9 +1,16 @@
+#include "argon2.h"
 
 void dump(SEXP key_, int n);
 void dump_uint8(uint8_t *key, int n);
-void unpack_key(SEXP key_, uint8_t key[32]);
-void unpack_salt(SEXP salt_, uint8_t salt[16]);
+void unpack_key(SEXP key_, const argon_params *params, uint8_t key[32]);
+int key_is_password(SEXP key_);
+void unpack_salt(SEXP salt_, const argon_params *params, uint8_t salt[16]);
+void password_to_key(SEXP password_, SEXP salt_, const argon_params *params, uint8_t key[32]);
 void unpack_bytes(SEXP bytes_, uint8_t *buf, size_t N);
 int hexstring_to_bytes(const char *str, uint8_t *buf, int nbytes);
 char *bytes_to_hex(uint8_t *buf, size_t len);
 SEXP wrap_bytes_for_return(uint8_t *buf, size_t N, SEXP type_);
+void unpack_additional_data(SEXP additional_data_, uint8_t **ad, size_t *ad_len);
+int unpack_threads(SEXP threads_);
+const char *temp_filename(const char *filename);
+int replace_file(const char *tmpname, const char *filename);
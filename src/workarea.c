@@ -0,0 +1,139 @@
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#include "workarea.h"
+
+// Not using the R API in this file.  Callers decide how to report failure.
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Persistent Argon2 work area
+//
+// Argon2 with the default settings needs 100 MB of scratch memory.  Getting
+// fresh memory from the OS for every derivation means faulting in ~25k pages
+// each time, so the area is kept and reused across calls.
+//
+// Only an area up to the size the default settings need (WORKAREA_KEEP) is
+// kept.  A larger one, for a derivation with more 'memory', is unmapped by
+// workarea_release() as soon as that derivation finishes, so a single
+// costly call doesn't pin gigabytes for the rest of the session.  The kept
+// area is released when the package is unloaded.
+//
+// crypto_argon2() wipes the blocks it used before returning, so the area 
+// holds no secrets between calls.
+//
+// Only ever used from the main R thread.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void  *arena      = NULL;
+static size_t arena_size = 0;
+
+// Transparent huge pages are 2 MB on x86_64 and (usually) on arm64
+#define WORKAREA_ROUND ((size_t)2 * 1024 * 1024)
+
+// Largest area kept between calls: the default Argon2 memory of 100000 
+// blocks (ARGON2_BLOCKS in argon2.h), rounded up
+#define WORKAREA_KEEP \
+  (((size_t)100000 * 1024 + WORKAREA_ROUND - 1) / WORKAREA_ROUND * WORKAREA_ROUND)
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Map 'len' bytes of zeroed memory, prefaulted
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void *arena_map(size_t len) {
+#if defined(_WIN32)
+  return VirtualAlloc(NULL, len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_POPULATE) && !defined(MADV_HUGEPAGE)
+  // Without huge pages, let the kernel fault everything in up front
+  flags |= MAP_POPULATE;
+#endif
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+  
+#if defined(MADV_HUGEPAGE)
+  // Ask for huge pages *before* the memory is touched, otherwise it is 
+  // faulted in as small pages and only collapsed later (if ever)
+  madvise(p, len, MADV_HUGEPAGE);
+#if defined(MADV_POPULATE_WRITE)
+  if (madvise(p, len, MADV_POPULATE_WRITE) != 0)
+#endif
+  {
+    // Older kernels: touch each small page once
+    for (size_t i = 0; i < len; i += 4096) {
+      ((volatile uint8_t *)p)[i] = 0;
+    }
+  }
+#endif
+#if defined(MADV_DONTDUMP)
+  madvise(p, len, MADV_DONTDUMP);
+#endif
+  return p;
+#endif
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Unmap the arena
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void workarea_free(void) {
+  if (arena == NULL) return;
+#if defined(_WIN32)
+  VirtualFree(arena, 0, MEM_RELEASE);
+#else
+  munmap(arena, arena_size);
+#endif
+  arena      = NULL;
+  arena_size = 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Get a work area of at least 'n' bytes
+//
+// The returned memory is page aligned and belongs to the arena: do not 
+// free it.  It stays valid until the next call to workarea_get(), 
+// workarea_release() or workarea_free()
+//
+// @param n number of bytes
+// @return pointer to memory, or NULL if it couldn't be allocated
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void *workarea_get(size_t n) {
+  if (arena != NULL && n <= arena_size) {
+    return arena;
+  }
+  
+  workarea_free();
+  
+  size_t len = (n + WORKAREA_ROUND - 1) / WORKAREA_ROUND * WORKAREA_ROUND;
+  if (len < n) return NULL; // overflow
+  
+  arena = arena_map(len);
+  if (arena == NULL) return NULL;
+  arena_size = len;
+  
+  return arena;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Done with the work area for now.  Unmaps it if it is larger than is kept
+// between calls
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void workarea_release(void) {
+  if (arena_size > WORKAREA_KEEP) {
+    workarea_free();
+  }
+}
@@ -0,0 +1,5 @@
+#include <stddef.h>
+
+void *workarea_get(size_t n);
+void workarea_release(void);
+void workarea_free(void);